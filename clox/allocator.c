@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+void initAllocator(Allocator *allocator)
+{
+    memset(allocator, 0, sizeof(Allocator));
+}
+
+void freeAllocator(Allocator *allocator)
+{
+    PoolPage *page = allocator->pages;
+    while (page != NULL)
+    {
+        PoolPage *next = page->next;
+        free(page);
+        page = next;
+    }
+    initAllocator(allocator);
+}
+
+static void *systemReallocate(void *pointer, size_t newSize)
+{
+    if (newSize == 0)
+    {
+        free(pointer);
+        return NULL;
+    }
+
+    void *result = realloc(pointer, newSize);
+    if (result == NULL)
+        exit(1); // not enough memory
+    return result;
+}
+
+#ifndef NO_POOL_ALLOCATOR
+
+// Index of the smallest class that fits `size`. `size` must be in 1..POOL_MAX_SIZE
+static int sizeClass(size_t size)
+{
+    int index = 0;
+    size_t blockSize = POOL_MIN_SIZE;
+    while (blockSize < size)
+    {
+        blockSize <<= 1;
+        index++;
+    }
+    return index;
+}
+
+// Carves a fresh page into blocks of class `index` and threads them onto its free list
+static void refill(Allocator *allocator, int index)
+{
+    size_t blockSize = (size_t)POOL_MIN_SIZE << index;
+    PoolPage *page = malloc(POOL_PAGE_SIZE);
+    if (page == NULL)
+        exit(1); // not enough memory
+    page->next = allocator->pages;
+    page->blockSize = blockSize;
+    allocator->pages = page;
+    allocator->stats[index].pages++;
+
+    char *block = (char *)page + sizeof(PoolPage);
+    char *end = (char *)page + POOL_PAGE_SIZE;
+    PoolBlock *list = allocator->freeLists[index];
+    for (; block + blockSize <= end; block += blockSize)
+    {
+        PoolBlock *node = (PoolBlock *)block;
+        node->next = list;
+        list = node;
+    }
+    allocator->freeLists[index] = list;
+}
+
+static void *poolAllocate(Allocator *allocator, size_t size)
+{
+    int index = sizeClass(size);
+    if (allocator->freeLists[index] == NULL)
+        refill(allocator, index);
+
+    PoolBlock *block = allocator->freeLists[index];
+    allocator->freeLists[index] = block->next;
+
+    PoolStats *stats = &allocator->stats[index];
+    stats->allocations++;
+    if (++stats->live > stats->peak)
+        stats->peak = stats->live;
+    return block;
+}
+
+static void poolFree(Allocator *allocator, void *pointer, size_t size)
+{
+    int index = sizeClass(size);
+    PoolBlock *block = pointer;
+    block->next = allocator->freeLists[index];
+    allocator->freeLists[index] = block;
+    allocator->stats[index].frees++;
+    allocator->stats[index].live--;
+}
+
+// `oldSize` must be the size the block was last (re)allocated with: it alone decides
+// whether `pointer` came from a pool or from `realloc`
+void *poolReallocate(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize)
+{
+    bool oldPooled = pointer != NULL && oldSize <= POOL_MAX_SIZE;
+    bool newPooled = newSize != 0 && newSize <= POOL_MAX_SIZE;
+
+    if (!oldPooled && !newPooled)
+    {
+        if (pointer == NULL && newSize != 0)
+            allocator->largeAllocations++;
+        else if (pointer != NULL && newSize == 0)
+            allocator->largeFrees++;
+        return systemReallocate(pointer, newSize);
+    }
+
+    // Blocks of the same class can be reused as they are
+    if (oldPooled && newPooled && sizeClass(oldSize) == sizeClass(newSize))
+        return pointer;
+
+    void *result = NULL;
+    if (newPooled)
+        result = poolAllocate(allocator, newSize);
+    else if (newSize != 0)
+    {
+        allocator->largeAllocations++;
+        result = systemReallocate(NULL, newSize);
+    }
+
+    if (pointer != NULL)
+    {
+        if (result != NULL)
+            memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        if (oldPooled)
+            poolFree(allocator, pointer, oldSize);
+        else
+        {
+            allocator->largeFrees++;
+            free(pointer);
+        }
+    }
+    return result;
+}
+
+#else
+
+void *poolReallocate(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize)
+{
+    (void)oldSize; // only pools need it, to find the block's class
+    if (pointer == NULL && newSize != 0)
+        allocator->largeAllocations++;
+    else if (pointer != NULL && newSize == 0)
+        allocator->largeFrees++;
+    return systemReallocate(pointer, newSize);
+}
+
+#endif
+
+void printAllocatorStats(Allocator *allocator)
+{
+    fprintf(stderr, "== allocator ==\n");
+    fprintf(stderr, "%6s %10s %10s %8s %8s %6s\n", "class", "allocs", "frees", "live", "peak", "pages");
+    for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+    {
+        PoolStats *stats = &allocator->stats[i];
+        fprintf(stderr, "%6d %10zu %10zu %8zu %8zu %6zu\n", POOL_MIN_SIZE << i,
+                stats->allocations, stats->frees, stats->live, stats->peak, stats->pages);
+    }
+    fprintf(stderr, "%6s %10zu %10zu %8zu\n", "large", allocator->largeAllocations,
+            allocator->largeFrees, allocator->largeAllocations - allocator->largeFrees);
+}
\ No newline at end of file
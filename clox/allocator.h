@@ -0,0 +1,51 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common.h"
+
+// Size-class pool allocator underneath `reallocate()`.
+// Requests up to `POOL_MAX_SIZE` bytes are rounded up to a power-of-two class and served
+// from per-class free lists carved out of `POOL_PAGE_SIZE` pages. Pages belong to one VM
+// and are only returned to the system by `freeAllocator()`.
+// Larger requests go straight to `realloc`/`free`. Build with -DNO_POOL_ALLOCATOR to send everything there.
+
+#define POOL_MIN_SIZE 16 // Smallest class; keeps every block 16-byte aligned
+#define POOL_SIZE_CLASSES 5
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_SIZE_CLASSES - 1)) // 256
+#define POOL_PAGE_SIZE (16 * 1024)
+
+typedef struct PoolBlock
+{
+    struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct PoolPage
+{
+    struct PoolPage *next;
+    size_t blockSize; // Keeps the header 16 bytes, so blocks after it stay aligned
+} PoolPage;
+
+typedef struct
+{
+    size_t allocations; // Blocks handed out over the VM lifetime
+    size_t frees;       // Blocks given back
+    size_t live;        // Blocks currently in use
+    size_t peak;        // Highest `live` seen
+    size_t pages;       // Pages carved for this class
+} PoolStats;
+
+typedef struct
+{
+    PoolBlock *freeLists[POOL_SIZE_CLASSES];
+    PoolPage *pages;                    // Every page of every class, released by `freeAllocator()`
+    PoolStats stats[POOL_SIZE_CLASSES];
+    size_t largeAllocations;            // Requests above `POOL_MAX_SIZE` passed to `realloc`
+    size_t largeFrees;
+} Allocator;
+
+void initAllocator(Allocator *allocator);
+void freeAllocator(Allocator *allocator);
+void *poolReallocate(Allocator *allocator, void *pointer, size_t oldSize, size_t newSize);
+void printAllocatorStats(Allocator *allocator);
+
+#endif
\ No newline at end of file
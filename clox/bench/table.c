@@ -0,0 +1,178 @@
+// Micro-benchmark of `Table` operations, built and run by scripts/bench.sh.
+// Usage: table [keys]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define OPERATIONS 4000000 // Per measurement, so every key count does the same amount of work
+
+static VM vm;
+static ObjString **keys;   // Inserted keys
+static ObjString **misses; // Keys never inserted
+static int keyCount;
+
+static uint32_t seed = 2463534242u;
+
+// xorshift32, deterministic between runs and variants
+static uint32_t randomIndex(int bound)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % bound;
+}
+
+static ObjString *makeKey(const char *prefix, int i)
+{
+    char name[32];
+    int length = snprintf(name, sizeof(name), "%s%d", prefix, i);
+    return copyString(&vm, name, length);
+}
+
+static double seconds(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double start, long operations, int checksum)
+{
+    double elapsed = seconds() - start;
+    printf("%-10s %7d keys %8.1f ns/op  (%d)\n", name, keyCount, elapsed * 1e9 / operations, checksum);
+}
+
+static void fill(Table *table)
+{
+    for (int i = 0; i < keyCount; i++)
+        tableSet(table, keys[i], NUMBER_VAL(i));
+}
+
+static void benchInsert(void)
+{
+    int rounds = OPERATIONS / keyCount + 1;
+    int checksum = 0;
+    double start = seconds();
+    for (int round = 0; round < rounds; round++)
+    {
+        Table table;
+        initTable(&table);
+        fill(&table);
+        checksum += table.count;
+        freeTable(&table);
+    }
+    report("insert", start, (long)rounds * keyCount, checksum);
+}
+
+static void benchLookup(Table *table, ObjString **probes, const char *name)
+{
+    int checksum = 0;
+    Value value;
+    double start = seconds();
+    for (int i = 0; i < OPERATIONS; i++)
+        checksum += tableGet(table, probes[randomIndex(keyCount)], &value);
+    report(name, start, OPERATIONS, checksum);
+}
+
+// Half lookups, a quarter deletes and a quarter re-inserts, so deleted slots keep being reused
+static void benchMixed(Table *table)
+{
+    int checksum = 0;
+    Value value;
+    double start = seconds();
+    for (int i = 0; i < OPERATIONS; i++)
+    {
+        ObjString *key = keys[randomIndex(keyCount)];
+        switch (i & 3)
+        {
+        case 0:
+        case 1:
+            checksum += tableGet(table, key, &value);
+            break;
+        case 2:
+            checksum += tableDelete(table, key);
+            break;
+        case 3:
+            checksum += tableSet(table, key, NUMBER_VAL(i));
+            break;
+        }
+    }
+    report("mixed", start, OPERATIONS, checksum);
+}
+
+// A cache whose keys keep changing: every step retires the oldest live key, adds a new one and
+// looks up a random key, about half of them live. Only half of `keys` is live at any time
+static void benchChurn(void)
+{
+    Table table;
+    initTable(&table);
+    int live = keyCount / 2 > 0 ? keyCount / 2 : 1;
+    for (int i = 0; i < live; i++)
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+
+    int checksum = 0;
+    Value value;
+    double start = seconds();
+    for (int i = 0; i < OPERATIONS; i++)
+    {
+        tableDelete(&table, keys[i % keyCount]);
+        tableSet(&table, keys[(i + live) % keyCount], NUMBER_VAL(i));
+        checksum += tableGet(&table, keys[randomIndex(keyCount)], &value);
+    }
+    report("churn", start, OPERATIONS, checksum);
+    freeTable(&table);
+}
+
+// Interning lookups: by characters, as the compiler does for every identifier
+static void benchFindString(void)
+{
+    int checksum = 0;
+    double start = seconds();
+    for (int i = 0; i < OPERATIONS; i++)
+    {
+        ObjString *key = keys[randomIndex(keyCount)];
+        checksum += tableFindString(&vm.strings, key->chars, key->length, key->hash) == key;
+    }
+    report("intern", start, OPERATIONS, checksum);
+}
+
+int main(int argc, const char *argv[])
+{
+    keyCount = argc > 1 ? atoi(argv[1]) : 1024;
+    if (keyCount <= 0)
+    {
+        fprintf(stderr, "Usage: table [keys]\n");
+        exit(64);
+    }
+
+    initVM(&vm);
+    vm.nextGC = (size_t)-1; // keys are only referenced from C arrays, so nothing may be collected
+
+    keys = malloc(sizeof(ObjString *) * keyCount);
+    misses = malloc(sizeof(ObjString *) * keyCount);
+    for (int i = 0; i < keyCount; i++)
+    {
+        keys[i] = makeKey("key", i);
+        misses[i] = makeKey("miss", i);
+    }
+
+    Table table;
+    initTable(&table);
+    fill(&table);
+
+    benchInsert();
+    benchLookup(&table, keys, "hit");
+    benchLookup(&table, misses, "miss");
+    benchMixed(&table);
+    benchChurn();
+    benchFindString();
+
+    freeTable(&table);
+    free(keys);
+    free(misses);
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "build.h"
+#include "compiler.h"
+#include "file.h"
+#include "image.h"
+#include "intern.h"
+#include "memory.h"
+
+typedef struct
+{
+    char *path;
+    off_t size;
+} Script;
+
+typedef struct
+{
+    Script *scripts;
+    int count;
+    int capacity;
+    BuildOptions *options;
+    InternPool strings;
+    atomic_int next;          // Index of the next script to hand out
+    atomic_int compileErrors; // Scripts that didn't compile
+    atomic_int fileErrors;    // Files that couldn't be read or written
+} Build;
+
+static void addScript(Build *build, const char *path, off_t size)
+{
+    if (build->capacity < build->count + 1)
+    {
+        build->capacity = GROW_CAPACITY(build->capacity);
+        build->scripts = realloc(build->scripts, sizeof(Script) * build->capacity);
+        if (build->scripts == NULL)
+            exit(1); // not enough memory
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL)
+        exit(1); // not enough memory
+    build->scripts[build->count].path = copy;
+    build->scripts[build->count].size = size;
+    build->count++;
+}
+
+// Adds the script at `path`, or every `.lox` file under it if it is a directory
+static bool addPath(Build *build, const char *path)
+{
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    if (!S_ISDIR(info.st_mode))
+    {
+        addScript(build, path, info.st_size);
+        return true;
+    }
+
+    DIR *directory = opendir(path);
+    if (directory == NULL)
+    {
+        fprintf(stderr, "Could not open directory \"%s\".\n", path);
+        return false;
+    }
+
+    bool added = true;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue; // `.`, `..` and hidden files
+        size_t length = strlen(entry->d_name);
+        char *child = malloc(strlen(path) + length + 2);
+        if (child == NULL)
+            exit(1); // not enough memory
+        sprintf(child, "%s/%s", path, entry->d_name);
+
+        struct stat linkInfo;
+        if (lstat(child, &linkInfo) == 0 && stat(child, &info) == 0)
+        {
+            bool isLox = length > 4 && strcmp(entry->d_name + length - 4, ".lox") == 0;
+            // A symlinked directory may point back up the tree, so only real ones are walked
+            if (S_ISDIR(info.st_mode) ? !S_ISLNK(linkInfo.st_mode) : isLox)
+                added = addPath(build, child) && added;
+        }
+        free(child);
+    }
+    closedir(directory);
+    return added;
+}
+
+// Largest first, so one big script picked up last doesn't keep a single worker busy at the end
+static int compareSize(const void *a, const void *b)
+{
+    off_t sizeA = ((const Script *)a)->size;
+    off_t sizeB = ((const Script *)b)->size;
+    return (sizeA < sizeB) - (sizeA > sizeB);
+}
+
+// Compiles one script to the image beside it, in a VM of its own
+// @return `int` - exit status of this script
+static int buildScript(Build *build, const char *path)
+{
+    MappedFile source;
+    if (!mapFile(path, &source))
+    {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        return 74;
+    }
+
+    VM vm;
+    initVM(&vm);
+    vm.optimize = build->options->optimize;
+    vm.bufferTokens = build->options->bufferTokens;
+    vm.sharedStrings = &build->strings;
+
+    int status = 0;
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(&vm, source.bytes, &chunk))
+    {
+        fprintf(stderr, "Could not compile \"%s\".\n", path);
+        status = 65;
+    }
+    else
+    {
+        char *output = imagePath(path);
+        if (!saveImage(&vm, &chunk, hashSource(source.bytes, source.size), output))
+        {
+            fprintf(stderr, "Could not write image \"%s\".\n", output);
+            status = 74;
+        }
+        free(output);
+    }
+
+    releaseChunk(&vm, &chunk); // before `freeVM()`, which releases the pages it lives in
+    freeVM(&vm);
+    unmapFile(&source);
+    return status;
+}
+
+static void *worker(void *argument)
+{
+    Build *build = argument;
+    for (;;)
+    {
+        int index = atomic_fetch_add(&build->next, 1);
+        if (index >= build->count)
+            return NULL;
+
+        int status = buildScript(build, build->scripts[index].path);
+        if (status == 65)
+            atomic_fetch_add(&build->compileErrors, 1);
+        else if (status == 74)
+            atomic_fetch_add(&build->fileErrors, 1);
+    }
+}
+
+/*
+Compiles every script in `paths`, and every `.lox` file under the directories in it, to `.loxc`
+images that `clox <script>` then loads instead of compiling.
+@return `int` - exit status: 0, 65 if a script didn't compile, 74 if a file couldn't be read or written
+*/
+int buildImages(const char *paths[], int pathCount, BuildOptions *options)
+{
+    Build build;
+    build.scripts = NULL;
+    build.count = 0;
+    build.capacity = 0;
+    build.options = options;
+    atomic_init(&build.next, 0);
+    atomic_init(&build.compileErrors, 0);
+    atomic_init(&build.fileErrors, 0);
+
+    bool found = true;
+    for (int i = 0; i < pathCount; i++)
+        found = addPath(&build, paths[i]) && found;
+    if (build.count > 1)
+        qsort(build.scripts, build.count, sizeof(Script), compareSize);
+
+    int jobs = options->jobs > 0 ? options->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > build.count)
+        jobs = build.count;
+    if (jobs < 1)
+        jobs = 1;
+
+    initInternPool(&build.strings);
+    pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+    if (threads == NULL)
+        exit(1); // not enough memory
+
+    // The calling thread is one of the workers
+    int started = 0;
+    for (; started < jobs - 1; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker, &build) != 0)
+            break; // the ones running will take the remaining scripts
+    }
+    worker(&build);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    freeInternPool(&build.strings);
+
+    int compileErrors = atomic_load(&build.compileErrors);
+    int fileErrors = atomic_load(&build.fileErrors);
+    printf("Built %d of %d scripts with %d workers\n", build.count - compileErrors - fileErrors, build.count,
+           started + 1);
+    for (int i = 0; i < build.count; i++)
+        free(build.scripts[i].path);
+    free(build.scripts);
+    return fileErrors > 0 || !found ? 74 : compileErrors > 0 ? 65 : 0;
+}
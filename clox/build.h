@@ -0,0 +1,19 @@
+#ifndef clox_build_h
+#define clox_build_h
+
+#include "common.h"
+
+// `clox build`: compiles many scripts to `.loxc` images at once (see image.h).
+// Scripts are handed out to a pool of worker threads, each compiling in a VM of its own.
+// The VMs share one intern pool (see intern.h), so strings common to the scripts are made once.
+
+typedef struct
+{
+    int jobs;          // Worker threads, counting the calling one. 0 for one per core
+    bool optimize;     // Compile through the optimiser, like -O
+    bool bufferTokens; // Scan each source before parsing it, like -T
+} BuildOptions;
+
+int buildImages(const char *paths[], int pathCount, BuildOptions *options);
+
+#endif
@@ -1,20 +1,25 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "memory.h"
 
 void initChunk(Chunk *chunk)
 {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->sharedCode = false;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->sharedCode)
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk); // reset the fields
 }
@@ -26,12 +31,119 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // Most lines compile to several bytes, so only the start of each run is stored
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+// Drops every byte from `count` on, with the line runs that start there
+void truncateChunk(Chunk *chunk, int count)
+{
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count)
+        chunk->lineCount--;
+}
+
+// Operand bytes of an instruction, and the values it pops and then pushes
+typedef struct
+{
+    int8_t operandBytes; // -1 for opcodes that are never emitted
+    int8_t pops;
+    int8_t pushes;
+    bool local; // the operand is a local slot
+} StackEffect;
+
+static const StackEffect stackEffects[] = {
+    [OP_RETURN] = {0, 0, 0, false},
+    [OP_CONSTANT] = {1, 0, 1, false},
+    [OP_CONSTANT_LONG] = {3, 0, 1, false},
+    [OP_NEGATE] = {0, 1, 1, false},
+    [OP_PRINT] = {0, 1, 0, false},
+    [OP_NIL] = {0, 0, 1, false},
+    [OP_TRUE] = {0, 0, 1, false},
+    [OP_FALSE] = {0, 0, 1, false},
+    [OP_NOT] = {0, 1, 1, false},
+    [OP_OR] = {-1, 0, 0, false},
+    [OP_XOR] = {-1, 0, 0, false},
+    [OP_AND] = {-1, 0, 0, false},
+    [OP_EQUAL] = {0, 2, 1, false},
+    [OP_GREATER] = {0, 2, 1, false},
+    [OP_LESS] = {0, 2, 1, false},
+    [OP_DIAMOND] = {0, 2, 1, false},
+    [OP_ADD] = {0, 2, 1, false},
+    [OP_SUBTRACT] = {0, 2, 1, false},
+    [OP_MULTIPLY] = {0, 2, 1, false},
+    [OP_DIVIDE] = {0, 2, 1, false},
+    [OP_POP] = {0, 1, 0, false},
+    [OP_DEFINE_GLOBAL] = {1, 1, 0, false},
+    [OP_GET_GLOBAL] = {1, 0, 1, false},
+    [OP_SET_GLOBAL] = {1, 1, 1, false},
+    [OP_DEFINE_GLOBAL_LONG] = {3, 1, 0, false},
+    [OP_GET_GLOBAL_LONG] = {3, 0, 1, false},
+    [OP_SET_GLOBAL_LONG] = {3, 1, 1, false},
+    [OP_GET_LOCAL] = {1, 0, 1, true},
+    [OP_SET_LOCAL] = {1, 1, 1, true},
+    [OP_NOT_EQUAL] = {0, 2, 1, false},
+    [OP_GREATER_EQUAL] = {0, 2, 1, false},
+    [OP_LESS_EQUAL] = {0, 2, 1, false},
+    [OP_ADD_CONST] = {1, 1, 1, false},
+    [OP_GET_GLOBAL_ADD] = {1, 1, 1, false},
+    [OP_GET_LOCAL_ADD] = {1, 1, 1, true},
+    [OP_SET_GLOBAL_POP] = {1, 1, 0, false},
+    [OP_SET_LOCAL_POP] = {1, 1, 0, true},
+};
+
+// Bytes of operands following `op`, -1 for opcodes that are never emitted
+int operandBytes(uint8_t op)
+{
+    if (op >= sizeof(stackEffects) / sizeof(stackEffects[0]))
+        return -1;
+    return stackEffects[op].operandBytes;
+}
+
+/*
+Follows the stack through `chunk`, which has no jumps, so each instruction sees one depth.
+No instruction may pop more than is there, address a local slot at or above its own operands,
+or leave more than `maxDepth` values.
+@return `int` - offset of the first instruction that does, -1 if none does
+*/
+int checkStack(Chunk *chunk, int maxDepth)
+{
+    int depth = 0;
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int operands = operandBytes(chunk->code[offset]);
+        if (operands < 0 || offset + operands >= chunk->count)
+            return offset;
+        StackEffect effect = stackEffects[chunk->code[offset]];
+        if (depth < effect.pops)
+            return offset;
+        if (effect.local && chunk->code[offset + 1] >= depth - effect.pops)
+            return offset;
+
+        depth += effect.pushes - effect.pops;
+        if (depth > maxDepth)
+            return offset;
+        offset += 1 + operands;
+    }
+    return -1;
 }
 
 int addConstant(Chunk *chunk, Value value)
@@ -39,4 +151,22 @@ int addConstant(Chunk *chunk, Value value)
     writeValueArray(&chunk->constants, value);
     int appendIndex = chunk->constants.count - 1;
     return appendIndex;
+}
+
+// Returns the source line of the instruction byte at `offset`
+int getLine(Chunk *chunk, int offset)
+{
+    // Find the last run starting at or before `offset`
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high)
+    {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return chunk->lines[low].line;
 }
\ No newline at end of file
@@ -1,50 +1,77 @@
 #ifndef clox_chunk_h
 #define clox_chunk_h
 
-#include "memory.h"
 #include "value.h"
 
 typedef enum
 {
-    OP_RETURN,        // `return` statement
-    OP_CONSTANT,      // 16-bit constant
-    OP_CONSTANT_LONG, // 32-bit constant
-    OP_NEGATE,        // unary negation
-    OP_PRINT,         // print a
-    OP_NIL,           // nil
-    OP_TRUE,          // true
-    OP_FALSE,         // false
-    OP_NOT,           // !a
-    OP_OR,            // a || b
-    OP_XOR,           // a xor b
-    OP_AND,           // a && b
-    OP_EQUAL,         // a == b
-    OP_GREATER,       // a > b
-    OP_LESS,          // a < b
-    OP_DIAMOND,       // a <> b
-    OP_ADD,           // a + b
-    OP_SUBTRACT,      // a - b
-    OP_MULTIPLY,      // a * b
-    OP_DIVIDE,        // binary division
-    OP_POP,           // pop value off of stack and forgets it
-    OP_DEFINE_GLOBAL, // define global variable
-    OP_GET_GLOBAL,    // get global variable's value
-    OP_SET_GLOBAL,    // sets a new value to global variable
+    OP_RETURN,             // `return` statement
+    OP_CONSTANT,           // constant with 8-bit pool index
+    OP_CONSTANT_LONG,      // constant with 24-bit pool index
+    OP_NEGATE,             // unary negation
+    OP_PRINT,              // print a
+    OP_NIL,                // nil
+    OP_TRUE,               // true
+    OP_FALSE,              // false
+    OP_NOT,                // !a
+    OP_OR,                 // a || b
+    OP_XOR,                // a xor b
+    OP_AND,                // a && b
+    OP_EQUAL,              // a == b
+    OP_GREATER,            // a > b
+    OP_LESS,               // a < b
+    OP_DIAMOND,            // a <> b
+    OP_ADD,                // a + b
+    OP_SUBTRACT,           // a - b
+    OP_MULTIPLY,           // a * b
+    OP_DIVIDE,             // binary division
+    OP_POP,                // pop value off of stack and forgets it
+    OP_DEFINE_GLOBAL,      // define global variable
+    OP_GET_GLOBAL,         // get global variable's value
+    OP_SET_GLOBAL,         // sets a new value to global variable
+    OP_DEFINE_GLOBAL_LONG, // OP_DEFINE_GLOBAL with 24-bit slot
+    OP_GET_GLOBAL_LONG,    // OP_GET_GLOBAL with 24-bit slot
+    OP_SET_GLOBAL_LONG,    // OP_SET_GLOBAL with 24-bit slot
+    OP_GET_LOCAL,          // get local variable's value from its stack slot
+    OP_SET_LOCAL,          // sets a new value to local variable's stack slot
+    // Superinstructions, only produced by the peephole optimiser (see peephole.c)
+    OP_NOT_EQUAL,          // OP_EQUAL OP_NOT
+    OP_GREATER_EQUAL,      // OP_LESS OP_NOT
+    OP_LESS_EQUAL,         // OP_GREATER OP_NOT
+    OP_ADD_CONST,          // OP_CONSTANT OP_ADD, with 8-bit pool index
+    OP_GET_GLOBAL_ADD,     // OP_GET_GLOBAL OP_ADD
+    OP_GET_LOCAL_ADD,      // OP_GET_LOCAL OP_ADD
+    OP_SET_GLOBAL_POP,     // OP_SET_GLOBAL OP_POP, an assignment statement
+    OP_SET_LOCAL_POP,      // OP_SET_LOCAL OP_POP, an assignment statement
 } OpCode;
 
+// Start of a run of bytecode compiled from the same source line
+typedef struct
+{
+    int offset; // first byte of the run
+    int line;
+} LineStart;
+
 // Chunk acts like a dynamic array
 typedef struct
 {
     int count; // bytes in use
     int capacity;
     uint8_t *code;
-    int *lines;
+    bool sharedCode; // `code` points into a mapped image, and is neither written nor freed (see image.c)
+    int lineCount; // runs in use
+    int lineCapacity;
+    LineStart *lines; // run-length encoded line table, sorted by `offset`
     ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void truncateChunk(Chunk *chunk, int count);
+int operandBytes(uint8_t op);
+int checkStack(Chunk *chunk, int maxDepth);
 int addConstant(Chunk *chunk, Value value);
+int getLine(Chunk *chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -6,8 +6,30 @@
 #include <stdint.h>  // fixed-sized int types
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff // largest operand of the `_LONG` instructions
 
+// Build with -DNAN_BOXING to pack every `Value` into a single 64-bit word (see value.h)
+// Build with -DINCREMENTAL_GC to collect garbage in bounded steps (-DGC_STEP_BUDGET=n) instead of all at once
+// Build with -DFNV_HASH to hash strings byte by byte with FNV-1a instead of a word at a time
+// Build with -DNO_POOL_ALLOCATOR to bypass the size-class pools (see allocator.h), -DDEBUG_POOL_STATS to print their statistics on exit
+// Run with -O to compile through the IR optimiser (see optimizer.c)
+// Run with -T to scan the whole source into a token buffer before parsing it (see scanner.h)
+// Run with --compile path -o path.loxc to save a compiled image; `clox path` loads it instead while the source is unchanged (see image.h)
+// Run `clox build [-j jobs] path...` to compile many scripts to images on a pool of threads (see build.h)
+// Build with -DNO_PEEPHOLE to run chunks exactly as compiled, without superinstructions (see peephole.c)
+// Build with -DNO_SIMD_SCANNER to skip whitespace, comments and strings a byte at a time instead of 16 (see scanner.c)
+// Build with -DDEBUG_PROFILE_PAIRS to count executed instruction pairs and print the most frequent on exit
+// Build with -DDEBUG_STRESS_GC to collect garbage on every allocation, -DDEBUG_LOG_GC to trace collections
+
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION // VM prints each instruction before execution
+#endif
+
+// Threaded dispatch through a table of label addresses ("labels as values").
+// Only GCC and Clang support it; build with -DNO_COMPUTED_GOTO to force the `switch` loop.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #endif
\ No newline at end of file
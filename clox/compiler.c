@@ -1,43 +1,91 @@
+#include <stdio.h>
+
 #include "compiler.h"
 #include "parser.h"
 #include "debug.h"
-
-extern Parser parser;
-extern Chunk *compilingChunk;
-
-Compiler *current = NULL;
+#include "memory.h"
+#include "optimizer.h"
 
 static void initCompiler(Compiler *compiler)
 {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->constantIndices = NULL;
+    compiler->constantCapacity = 0;
+    compiler->lastInstruction = -1;
 }
 
-static void endCompiler()
+static void endCompiler(Parser *parser)
 {
-    emitReturn();
+    emitReturn(parser);
+    FREE_ARRAY(int, parser->compiler->constantIndices, parser->compiler->constantCapacity);
+
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!parser->hadError)
     {
-        disassembleChunk(currentChunk(), "code");
+        disassembleChunk(parser->chunk, "code");
     }
 #endif
 }
 
-bool compile(VM *vm, const char *source, Chunk *chunk)
+// Compiles from `tokens`, or straight from the scanner when it is NULL.
+// All of the state lives in this frame and in `vm`, so different VMs can compile at the same time
+static bool compileFrom(VM *vm, const char *source, TokenBuffer *tokens, Chunk *chunk)
 {
-    initScanner(source);
     Compiler compiler;
     initCompiler(&compiler);
-    initParser();
-    compilingChunk = chunk;
+    Parser parser;
+    initParser(&parser, vm, &compiler, chunk, tokens);
+    if (tokens == NULL)
+        initScanner(&parser.scanner, source);
+
+    // Nothing else references the constants yet, so the chunk is a root while it is compiled
+    vm->chunk = chunk;
+    vm->constantsCursor = 0;
+
+    advance(&parser);
+    while (!match(&parser, TOKEN_EOF))
+    {
+        declaration(&parser);
+    }
+    if (vm->optimize && !parser.hadError)
+        compiler.lastInstruction = optimizeChunk(&parser, chunk);
+    endCompiler(&parser);
+    vm->chunk = NULL;
 
-    advance();
-    while (!match(TOKEN_EOF))
+    // `run()` doesn't check the stack, so chunks that would overflow it are rejected here
+    int overflow = parser.hadError ? -1 : checkStack(chunk, STACK_MAX);
+    if (overflow >= 0)
     {
-        declaration(vm);
+        fprintf(stderr, "[line %d] Error: Too many values on the stack.\n", getLine(chunk, overflow));
+        parser.hadError = true;
     }
-    endCompiler();
     return !parser.hadError;
 }
+
+bool compile(VM *vm, const char *source, Chunk *chunk)
+{
+    VM *previous = setHeapVM(vm);
+    bool compiled;
+    if (!vm->bufferTokens)
+        compiled = compileFrom(vm, source, NULL, chunk);
+    else
+    {
+        TokenBuffer tokens;
+        initTokenBuffer(&tokens);
+        scanTokens(&tokens, source);
+        compiled = compileFrom(vm, source, &tokens, chunk);
+        freeTokenBuffer(&tokens);
+    }
+    setHeapVM(previous);
+    return compiled;
+}
+
+// Compiles tokens scanned earlier, which can be compiled any number of times
+bool compileTokens(VM *vm, TokenBuffer *tokens, Chunk *chunk)
+{
+    VM *previous = setHeapVM(vm);
+    bool compiled = compileFrom(vm, tokens->source, tokens, chunk);
+    setHeapVM(previous);
+    return compiled;
+}
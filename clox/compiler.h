@@ -2,6 +2,8 @@
 #define clox_compiler_h
 
 #include "chunk.h"
+#include "scanner.h"
+#include "vm.h"
 
 typedef struct
 {
@@ -14,8 +16,12 @@ typedef struct
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+    int *constantIndices; // Open-addressed set of constant pool indices, de-duplicates literals
+    int constantCapacity;
+    int lastInstruction;  // Offset of the last instruction emitted, -1 before the first
 } Compiler;
 
 bool compile(VM *vm, const char *source, Chunk *chunk);
+bool compileTokens(VM *vm, TokenBuffer *tokens, Chunk *chunk);
 
 #endif
\ No newline at end of file
@@ -1,8 +1,56 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "value.h"
 
+static const char *const opcodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_OR] = "OP_OR",
+    [OP_XOR] = "OP_XOR",
+    [OP_AND] = "OP_AND",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_DIAMOND] = "OP_DIAMOND",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD_CONST] = "OP_ADD_CONST",
+    [OP_GET_GLOBAL_ADD] = "OP_GET_GLOBAL_ADD",
+    [OP_GET_LOCAL_ADD] = "OP_GET_LOCAL_ADD",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+    if (opcode < sizeof(opcodeNames) / sizeof(opcodeNames[0]) && opcodeNames[opcode] != NULL)
+        return opcodeNames[opcode];
+    return "OP_UNKNOWN";
+}
+
 void disassembleChunk(Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
@@ -28,13 +76,42 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 2; // opcode + 'constant index' operand
 }
 
+static uint32_t readLong(Chunk *chunk, int offset)
+{
+    return chunk->code[offset] | (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+}
+
+static int constantLongInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint32_t constant = readLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4; // opcode + 24-bit 'constant index' operand
+}
+
+static int byteInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 2; // opcode + 'slot' operand
+}
+
+static int longInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint32_t slot = readLong(chunk, offset + 1);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 4; // opcode + 24-bit 'slot' operand
+}
+
 int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
         printf("\t| "); // instruction comes from new source line, just put a delimeter
     else
-        printf("%4d ", chunk->lines[offset]); // otherwise put line number first
+        printf("%4d ", line); // otherwise put line number first
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction)
@@ -42,11 +119,21 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return byteInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return longInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return longInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return longInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_GET_LOCAL:
+        return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:
+        return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_PRINT:
         return simpleInstruction("OP_PRINT", offset);
     case OP_RETURN:
@@ -54,7 +141,7 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
-        return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
+        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -81,8 +168,78 @@ int disassembleInstruction(Chunk *chunk, int offset)
         return simpleInstruction("OP_LESS", offset);
     case OP_DIAMOND:
         return simpleInstruction("OP_DIAMOND", offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction("OP_LESS_EQUAL", offset);
+    case OP_ADD_CONST:
+        return constantInstruction("OP_ADD_CONST", chunk, offset);
+    case OP_GET_GLOBAL_ADD:
+        return byteInstruction("OP_GET_GLOBAL_ADD", chunk, offset);
+    case OP_GET_LOCAL_ADD:
+        return byteInstruction("OP_GET_LOCAL_ADD", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+        return byteInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+
+#ifdef DEBUG_PROFILE_PAIRS
+#define PROFILE_TOP 25 // pairs printed by `printPairProfile()`
+
+// Executed instruction pairs, [first][second], over every chunk the process has run
+static uint64_t pairCounts[UINT8_COUNT][UINT8_COUNT];
+static int previousOpcode = -1;
+
+void profileInstruction(uint8_t opcode)
+{
+    if (previousOpcode >= 0)
+        pairCounts[previousOpcode][opcode]++;
+    previousOpcode = opcode == OP_RETURN ? -1 : opcode; // chunks don't flow into each other
+}
+
+typedef struct
+{
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} PairCount;
+
+static int comparePairs(const void *a, const void *b)
+{
+    uint64_t countA = ((const PairCount *)a)->count;
+    uint64_t countB = ((const PairCount *)b)->count;
+    return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+void printPairProfile(void)
+{
+    static PairCount pairs[UINT8_COUNT * UINT8_COUNT];
+    int pairCount = 0;
+    uint64_t total = 0;
+    for (int first = 0; first < UINT8_COUNT; first++)
+    {
+        for (int second = 0; second < UINT8_COUNT; second++)
+        {
+            if (pairCounts[first][second] == 0)
+                continue;
+            pairs[pairCount++] = (PairCount){first, second, pairCounts[first][second]};
+            total += pairCounts[first][second];
+        }
+    }
+    qsort(pairs, pairCount, sizeof(PairCount), comparePairs);
+
+    fprintf(stderr, "== instruction pairs ==\n");
+    for (int i = 0; i < pairCount && i < PROFILE_TOP; i++)
+    {
+        fprintf(stderr, "%-22s %-22s %12llu %5.1f%%\n", opcodeName(pairs[i].first), opcodeName(pairs[i].second),
+                (unsigned long long)pairs[i].count, 100.0 * pairs[i].count / total);
+    }
+}
+#endif
\ No newline at end of file
@@ -5,5 +5,11 @@
 
 void disassembleChunk(Chunk *chunk, const char *name); // disassemble entire chunk
 int disassembleInstruction(Chunk *chunk, int offset);  // disassemble exact byte in chunk
+const char *opcodeName(uint8_t opcode);
+
+#ifdef DEBUG_PROFILE_PAIRS
+void profileInstruction(uint8_t opcode); // count `opcode` as executed right after the previous one
+void printPairProfile(void);             // print the most frequent pairs to stderr
+#endif
 
 #endif
\ No newline at end of file
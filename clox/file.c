@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+
+// Reads everything left in `fd`, for files that can't be mapped. `sizeHint` is the expected size
+static bool readAll(int fd, size_t sizeHint, MappedFile *file)
+{
+    size_t capacity = sizeHint + 2 < 4096 ? 4096 : sizeHint + 2; // room for the '\0' and to see EOF
+    size_t size = 0;
+    char *bytes = malloc(capacity);
+    if (bytes == NULL)
+        return false;
+
+    for (;;)
+    {
+        if (size + 1 == capacity)
+        {
+            capacity *= 2;
+            char *grown = realloc(bytes, capacity);
+            if (grown == NULL)
+            {
+                free(bytes);
+                return false;
+            }
+            bytes = grown;
+        }
+
+        ssize_t bytesRead = read(fd, bytes + size, capacity - size - 1);
+        if (bytesRead < 0)
+        {
+            free(bytes);
+            return false;
+        }
+        if (bytesRead == 0)
+            break;
+        size += bytesRead;
+    }
+
+    bytes[size] = '\0';
+    file->bytes = bytes;
+    file->size = size;
+    file->mapped = false;
+    return true;
+}
+
+/*
+Maps the file at `path` read-only, or reads it if it can't be mapped with a '\0' after it.
+@return `bool` - could it be opened and read. If not, `errno` says why
+*/
+bool mapFile(const char *path, MappedFile *file)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (S_ISREG(info.st_mode) && info.st_size > 0 && info.st_size % pageSize != 0)
+    {
+        void *bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes != MAP_FAILED)
+        {
+            close(fd); // the mapping keeps the file open
+            madvise(bytes, info.st_size, MADV_SEQUENTIAL); // only a hint; scanning reads front to back
+            file->bytes = bytes;
+            file->size = info.st_size;
+            file->mapped = true;
+            return true;
+        }
+    }
+
+    bool copied = readAll(fd, S_ISREG(info.st_mode) ? (size_t)info.st_size : 0, file);
+    close(fd);
+    return copied;
+}
+
+void unmapFile(MappedFile *file)
+{
+    if (file->mapped)
+        munmap((void *)file->bytes, file->size);
+    else
+        free((void *)file->bytes);
+    file->bytes = NULL;
+    file->size = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef clox_file_h
+#define clox_file_h
+
+#include "common.h"
+
+// Contents of a file, mapped into memory rather than copied where possible: pages are only read
+// in as they are touched, and processes mapping the same file share them in the page cache.
+// The contents are always followed by a '\0', which the scanner relies on. A mapping gets it for
+// free from the zero-filled rest of its last page, so files filling whole pages, empty files and
+// anything that can't be mapped (pipes, for one) are read into a copy instead.
+// A mapped file must not shrink while it is in use; touching the cut-off pages is fatal.
+
+typedef struct
+{
+    const char *bytes; // `size` bytes and a '\0'
+    size_t size;
+    bool mapped; // From `mmap`, otherwise a `malloc`ed copy
+} MappedFile;
+
+bool mapFile(const char *path, MappedFile *file);
+void unmapFile(MappedFile *file);
+
+#endif
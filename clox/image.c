@@ -0,0 +1,447 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+
+// 64 bits, so a stale image is never mistaken for a fresh one. Eight characters per multiply,
+// like `hashString()`, since large sources are hashed on every start
+uint64_t hashSource(const char *source, size_t length)
+{
+    uint64_t hash = (uint64_t)length * 0x9e3779b97f4a7c15u;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, source + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 32;
+    }
+    if (i < length)
+    {
+        uint64_t word = 0;
+        memcpy(&word, source + i, length - i);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 32;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Where the image compiled from the source at `path` is cached: `foo.lox` -> `foo.loxc`
+char *imagePath(const char *path)
+{
+    size_t length = strlen(path);
+    char *imagePath = malloc(length + sizeof(".loxc"));
+    if (imagePath == NULL)
+        exit(1); // not enough memory
+    memcpy(imagePath, path, length);
+    bool isLox = length >= 4 && strcmp(path + length - 4, ".lox") == 0;
+    strcpy(imagePath + length, isLox ? "c" : ".loxc");
+    return imagePath;
+}
+
+typedef struct
+{
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} ImageWriter;
+
+static void writeBytes(ImageWriter *writer, const void *bytes, size_t count)
+{
+    if (writer->capacity < writer->count + count)
+    {
+        while (writer->capacity < writer->count + count)
+            writer->capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL)
+            exit(1); // not enough memory
+    }
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void writeU32(ImageWriter *writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++)
+        bytes[i] = (value >> (8 * i)) & 0xff;
+    writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(ImageWriter *writer, uint64_t value)
+{
+    writeU32(writer, (uint32_t)value);
+    writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writeText(ImageWriter *writer, ObjString *string)
+{
+    writeU32(writer, string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static void writeConstant(ImageWriter *writer, Value value)
+{
+    uint8_t tag;
+    if (IS_NIL(value))
+        tag = IMAGE_NIL;
+    else if (IS_BOOL(value))
+        tag = AS_BOOL(value) ? IMAGE_TRUE : IMAGE_FALSE;
+    else if (IS_NUMBER(value))
+        tag = IMAGE_NUMBER;
+    else
+        tag = IMAGE_STRING; // the compiler only adds strings and numbers to the pool
+    writeBytes(writer, &tag, 1);
+
+    if (tag == IMAGE_NUMBER)
+    {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        writeU64(writer, bits);
+    }
+    else if (tag == IMAGE_STRING)
+        writeText(writer, AS_STRING(value));
+}
+
+/*
+Saves `chunk`, compiled by `vm` from a source hashing to `sourceHash`, to `file`.
+@return `bool` - was the whole image written
+*/
+bool writeImage(VM *vm, Chunk *chunk, uint64_t sourceHash, FILE *file)
+{
+    ImageWriter writer = {NULL, 0, 0};
+    writeBytes(&writer, IMAGE_MAGIC, 4);
+    writeU32(&writer, IMAGE_VERSION);
+    writeU64(&writer, sourceHash);
+
+    writeU32(&writer, vm->globalNames.count);
+    for (int i = 0; i < vm->globalNames.count; i++)
+        writeText(&writer, AS_STRING(vm->globalNames.values[i]));
+
+    writeU32(&writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+        writeConstant(&writer, chunk->constants.values[i]);
+
+    writeU32(&writer, chunk->count);
+    writeBytes(&writer, chunk->code, chunk->count);
+
+    writeU32(&writer, chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++)
+    {
+        writeU32(&writer, chunk->lines[i].offset);
+        writeU32(&writer, chunk->lines[i].line);
+    }
+
+    bool written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    free(writer.bytes);
+    return written;
+}
+
+/*
+Saves `chunk` as the image file at `path`. The image is written beside it under a temporary name,
+then renamed over it: processes running the old image from a mapping (see file.h) keep it, and
+none ever maps a partly written one.
+@return `bool` - was the image saved. If not, `path` is left as it was
+*/
+bool saveImage(VM *vm, Chunk *chunk, uint64_t sourceHash, const char *path)
+{
+    static atomic_uint saves = 0; // tells apart the temporary files of one process's threads
+    size_t length = strlen(path) + 32;
+    char *temporary = malloc(length);
+    if (temporary == NULL)
+        exit(1); // not enough memory
+    snprintf(temporary, length, "%s.%d-%u.tmp", path, (int)getpid(), atomic_fetch_add(&saves, 1));
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "wb");
+    bool saved = file != NULL && writeImage(vm, chunk, sourceHash, file);
+    if (file != NULL && fclose(file) != 0)
+        saved = false;
+    else if (file == NULL && fd >= 0)
+        close(fd);
+    saved = saved && rename(temporary, path) == 0;
+    if (!saved && fd >= 0)
+        unlink(temporary);
+    free(temporary);
+    return saved;
+}
+
+// Reads fields out of an image. Reading past its end sets `failed` and yields zeros
+typedef struct
+{
+    const uint8_t *bytes;
+    size_t size;
+    size_t offset;
+    bool failed;
+} ImageReader;
+
+static const uint8_t *readBytes(ImageReader *reader, size_t count)
+{
+    if (reader->failed || count > reader->size - reader->offset)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->bytes + reader->offset;
+    reader->offset += count;
+    return bytes;
+}
+
+static uint32_t readU32(ImageReader *reader)
+{
+    const uint8_t *bytes = readBytes(reader, 4);
+    if (bytes == NULL)
+        return 0;
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t readU64(ImageReader *reader)
+{
+    uint64_t low = readU32(reader);
+    return low | ((uint64_t)readU32(reader) << 32);
+}
+
+// Interns a string stored as u32 length and characters, NULL if the image ends first
+static ObjString *readText(VM *vm, ImageReader *reader)
+{
+    uint32_t length = readU32(reader);
+    if (length > INT32_MAX)
+        reader->failed = true;
+    const uint8_t *chars = readBytes(reader, length);
+    if (chars == NULL)
+        return NULL;
+    return copyString(vm, (const char *)chars, (int)length);
+}
+
+static bool readHeader(ImageReader *reader, uint64_t *sourceHash)
+{
+    const uint8_t *magic = readBytes(reader, 4);
+    if (magic == NULL || memcmp(magic, IMAGE_MAGIC, 4) != 0 || readU32(reader) != IMAGE_VERSION)
+        return false;
+    *sourceHash = readU64(reader);
+    return !reader->failed;
+}
+
+/*
+Reads the source hash from the header of `image`, to check it before loading the rest.
+@return `bool` - is `image` an image of this version
+*/
+bool readImageHash(const uint8_t *image, size_t size, uint64_t *sourceHash)
+{
+    ImageReader reader = {image, size, 0, false};
+    return readHeader(&reader, sourceHash);
+}
+
+/*
+Checks that the code is made of whole, known instructions ending with `OP_RETURN` and
+points every constant operand into the pool. Global operands are rewritten from the slots
+of the compiling VM to the slots of this one, `slots[i]` being the slot of global `i`.
+@return `bool` - is the code valid, and did every slot fit its operand
+*/
+static bool relocateCode(Chunk *chunk, int *slots, int globalCount)
+{
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t *code = &chunk->code[offset];
+        int operands = operandBytes(code[0]);
+        if (operands < 0 || offset + operands >= chunk->count)
+            return false;
+
+        uint32_t operand = 0;
+        if (operands == 1)
+            operand = code[1];
+        else if (operands == 3)
+            operand = code[1] | (code[2] << 8) | (code[3] << 16);
+
+        switch (code[0])
+        {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_ADD_CONST:
+            if (operand >= (uint32_t)chunk->constants.count)
+                return false;
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL_ADD:
+        case OP_SET_GLOBAL_POP:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        {
+            if (operand >= (uint32_t)globalCount)
+                return false;
+            uint32_t slot = slots[operand];
+            if (slot == operand)
+                break; // unchanged, and shared code must not be written to
+            if (slot > (operands == 1 ? UINT8_MAX : UINT24_MAX))
+                return false;
+            code[1] = slot & 0xff;
+            if (operands == 3)
+            {
+                code[2] = (slot >> 8) & 0xff;
+                code[3] = (slot >> 16) & 0xff;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        offset += 1 + operands;
+    }
+    return chunk->count > 0 && chunk->code[chunk->count - 1] == OP_RETURN;
+}
+
+static bool readConstants(VM *vm, ImageReader *reader, Chunk *chunk)
+{
+    uint32_t count = readU32(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; i++)
+    {
+        const uint8_t *tag = readBytes(reader, 1);
+        if (tag == NULL)
+            return false;
+
+        Value value;
+        switch (*tag)
+        {
+        case IMAGE_NIL:
+            value = NIL_VAL;
+            break;
+        case IMAGE_FALSE:
+            value = BOOL_VAL(false);
+            break;
+        case IMAGE_TRUE:
+            value = BOOL_VAL(true);
+            break;
+        case IMAGE_NUMBER:
+        {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            value = NUMBER_VAL(number);
+            break;
+        }
+        case IMAGE_STRING:
+        {
+            ObjString *string = readText(vm, reader);
+            if (string == NULL)
+                return false;
+            value = OBJ_VAL(string);
+            break;
+        }
+        default:
+            return false;
+        }
+
+        push(vm, value); // the pool may grow, and collect, before `value` is in it
+        addConstant(chunk, value);
+        pop(vm);
+    }
+    return !reader->failed;
+}
+
+// Reads the code and its line runs. With `shareCode`, the chunk uses the code where it is in the image
+static bool readCode(ImageReader *reader, Chunk *chunk, bool shareCode)
+{
+    uint32_t count = readU32(reader);
+    const uint8_t *code = readBytes(reader, count);
+    if (code == NULL || count == 0 || count > INT32_MAX)
+        return false;
+    chunk->capacity = count;
+    chunk->count = count;
+    if (shareCode)
+    {
+        chunk->code = (uint8_t *)code;
+        chunk->sharedCode = true;
+    }
+    else
+    {
+        chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+        memcpy(chunk->code, code, count);
+    }
+
+    uint32_t lineCount = readU32(reader);
+    if (lineCount == 0 || lineCount > count || lineCount > (reader->size - reader->offset) / 8)
+        return false;
+    chunk->lines = GROW_ARRAY(LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = lineCount;
+    chunk->lineCount = lineCount;
+    for (uint32_t i = 0; i < lineCount; i++)
+    {
+        LineStart *run = &chunk->lines[i];
+        run->offset = readU32(reader);
+        run->line = readU32(reader);
+        // Runs must start at the first byte and be sorted, or `getLine()` can't search them
+        bool sorted = i == 0 ? run->offset == 0 : run->offset > chunk->lines[i - 1].offset;
+        if (!sorted || run->offset >= (int)count)
+            return false;
+    }
+    return !reader->failed;
+}
+
+/*
+Loads `image` into the empty `chunk`, defining slots in `vm` for the globals it names.
+Anything malformed makes the load fail rather than reach the VM, including code that would
+underflow or overflow the stack or read a local that isn't there (see `checkStack()`).
+With `shareImage`, the caller keeps `image` for as long as `chunk` lives: if the globals land in
+the slots they were compiled for, as they do in a fresh VM, the code is then run where it lies in
+`image` instead of being copied. Mapped read-only, those pages are shared by every process running it.
+@return `bool` - was `chunk` loaded. If not, it is left empty
+*/
+bool readImage(VM *vm, const uint8_t *image, size_t size, Chunk *chunk, bool shareImage)
+{
+    ImageReader reader = {image, size, 0, false};
+    uint64_t sourceHash;
+    if (!readHeader(&reader, &sourceHash))
+        return false;
+
+    // The chunk is the root of its constants while they are loaded
+    VM *previous = setHeapVM(vm);
+    vm->chunk = chunk;
+    vm->constantsCursor = 0;
+
+    uint32_t globalCount = readU32(&reader);
+    int *slots = NULL;
+    bool loaded = globalCount <= (reader.size - reader.offset) / 4;
+    if (loaded)
+    {
+        slots = malloc(sizeof(int) * (globalCount + 1));
+        if (slots == NULL)
+            exit(1); // not enough memory
+    }
+    bool sameSlots = true;
+    for (uint32_t i = 0; loaded && i < globalCount; i++)
+    {
+        ObjString *name = readText(vm, &reader);
+        if (name == NULL)
+            loaded = false;
+        else
+        {
+            slots[i] = globalSlot(vm, name);
+            sameSlots = sameSlots && slots[i] == (int)i;
+        }
+    }
+
+    loaded = loaded && readConstants(vm, &reader, chunk) &&
+             readCode(&reader, chunk, shareImage && sameSlots) &&
+             relocateCode(chunk, slots, (int)globalCount) && checkStack(chunk, STACK_MAX) < 0;
+    free(slots);
+    vm->chunk = NULL;
+
+    if (!loaded)
+        freeChunk(chunk);
+    setHeapVM(previous);
+    return loaded;
+}
@@ -0,0 +1,39 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+// Compiled chunk saved to a `.loxc` file, so a script can start without being compiled again.
+// All fields are little-endian; `u32` and `u64` are unsigned 32- and 64-bit integers:
+//   "LOXC", u32 version, u64 hash of the source it was compiled from
+//   u32 global count, then each global name as u32 length and characters, in slot order
+//   u32 constant count, then each constant as a u8 `ImageTag` and its payload:
+//       numbers as the u64 bits of the double, strings as u32 length and characters
+//   u32 code length and the code, which ends with `OP_RETURN`
+//   u32 line run count, then each run as u32 offset and u32 line
+// Global slots are assigned per VM, so the loader looks each name up and rewrites the operands.
+// String hashes aren't stored: loaded strings are interned again, which recomputes them.
+
+#define IMAGE_MAGIC "LOXC"
+#define IMAGE_VERSION 1 // Bump whenever opcodes or the layout above change
+
+typedef enum
+{
+    IMAGE_NIL,
+    IMAGE_FALSE,
+    IMAGE_TRUE,
+    IMAGE_NUMBER,
+    IMAGE_STRING,
+} ImageTag;
+
+uint64_t hashSource(const char *source, size_t length);
+char *imagePath(const char *path);
+bool writeImage(VM *vm, Chunk *chunk, uint64_t sourceHash, FILE *file);
+bool saveImage(VM *vm, Chunk *chunk, uint64_t sourceHash, const char *path);
+bool readImageHash(const uint8_t *image, size_t size, uint64_t *sourceHash);
+bool readImage(VM *vm, const uint8_t *image, size_t size, Chunk *chunk, bool shareImage);
+
+#endif
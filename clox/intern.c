@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+
+void initInternPool(InternPool *pool)
+{
+    for (int i = 0; i < INTERN_SHARDS; i++)
+    {
+        InternShard *shard = &pool->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->strings = NULL;
+        shard->count = 0;
+        shard->capacity = 0;
+    }
+}
+
+// Frees every string in `pool`. No VM may still reference one
+void freeInternPool(InternPool *pool)
+{
+    for (int i = 0; i < INTERN_SHARDS; i++)
+    {
+        InternShard *shard = &pool->shards[i];
+        for (int j = 0; j < shard->capacity; j++)
+            free(shard->strings[j]);
+        free(shard->strings);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+// The low hash bits picked the shard, so slots are indexed by the bits above them
+static int shardSlot(uint32_t hash, int capacity)
+{
+    return (int)((hash / INTERN_SHARDS) & (uint32_t)(capacity - 1));
+}
+
+static void growShard(InternShard *shard)
+{
+    int capacity = shard->capacity < 64 ? 64 : shard->capacity * 2;
+    // Plain `calloc`: the pool belongs to no VM, so nothing here may go through `reallocate()`
+    ObjString **strings = calloc(capacity, sizeof(ObjString *));
+    if (strings == NULL)
+        exit(1); // not enough memory
+
+    for (int i = 0; i < shard->capacity; i++)
+    {
+        ObjString *string = shard->strings[i];
+        if (string == NULL)
+            continue;
+        int slot = shardSlot(string->hash, capacity);
+        while (strings[slot] != NULL)
+            slot = (slot + 1) & (capacity - 1);
+        strings[slot] = string;
+    }
+
+    free(shard->strings);
+    shard->strings = strings;
+    shard->capacity = capacity;
+}
+
+/*
+Finds the pooled string with these characters, adding a copy of them if there is none.
+Safe to call from any number of threads at once.
+@return `ObjString *` - a string no VM may free or unmark
+*/
+ObjString *internShared(InternPool *pool, const char *chars, int length, uint32_t hash)
+{
+    InternShard *shard = &pool->shards[hash & (INTERN_SHARDS - 1)];
+    pthread_mutex_lock(&shard->lock);
+
+    if ((shard->count + 1) * 4 > shard->capacity * 3)
+        growShard(shard);
+
+    int slot = shardSlot(hash, shard->capacity);
+    for (;;)
+    {
+        ObjString *string = shard->strings[slot];
+        if (string == NULL)
+            break;
+        if (string->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return string;
+        }
+        slot = (slot + 1) & (shard->capacity - 1);
+    }
+
+    ObjString *string = malloc(STRING_SIZE(length));
+    if (string == NULL)
+        exit(1); // not enough memory
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = true; // so collectors neither trace nor sweep it
+    string->obj.next = NULL;
+    string->length = length;
+    string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+
+    shard->strings[slot] = string;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
@@ -0,0 +1,35 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include <pthread.h>
+
+#include "common.h"
+#include "object.h"
+
+// String intern pool shared by VMs on different threads, e.g. the workers of `clox build`.
+// A VM pointed at one interns every string there instead of in its own `strings` table, so names
+// and literals common to many scripts are allocated and hashed into a table once.
+// The strings live outside every VM's heap: they are never collected, and are born marked, so
+// a collector that reaches one only ever reads it.
+// The table is split into shards by hash, each behind its own lock, so workers rarely wait.
+
+#define INTERN_SHARDS 64 // Power of two; the low bits of the hash pick the shard
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    ObjString **strings; // Open-addressed by hash, NULL for empty slots
+    int count;
+    int capacity;
+} InternShard;
+
+typedef struct InternPool
+{
+    InternShard shards[INTERN_SHARDS];
+} InternPool;
+
+void initInternPool(InternPool *pool);
+void freeInternPool(InternPool *pool);
+ObjString *internShared(InternPool *pool, const char *chars, int length, uint32_t hash);
+
+#endif
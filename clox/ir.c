@@ -0,0 +1,464 @@
+#include <stdlib.h>
+
+#include "ir.h"
+#include "parser.h"
+#include "peephole.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static void *arenaAllocate(Arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->size)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (block == NULL)
+            exit(1); // not enough memory
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = capacity;
+        arena->blocks = block;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+void initProgram(Program *program)
+{
+    program->arena.blocks = NULL;
+    program->statements = NULL;
+    program->count = 0;
+    program->capacity = 0;
+}
+
+void freeProgram(Program *program)
+{
+    ArenaBlock *block = program->arena.blocks;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(program->statements);
+    initProgram(program);
+}
+
+Node *newNode(Program *program, NodeType type, int line)
+{
+    Node *node = arenaAllocate(&program->arena, sizeof(Node));
+    node->type = type;
+    node->op = 0;
+    node->line = line;
+    node->slot = 0;
+    node->value = NIL_VAL;
+    node->left = NULL;
+    node->right = NULL;
+    node->fails = false;
+    node->mayFail = false;
+    node->temp = -1;
+    node->reuse = false;
+    node->skipped = false;
+    node->temps = 0;
+    return node;
+}
+
+static void addStatement(Program *program, Node *statement)
+{
+    if (program->capacity < program->count + 1)
+    {
+        program->capacity = program->capacity < 8 ? 8 : program->capacity * 2;
+        program->statements = realloc(program->statements, sizeof(Node *) * program->capacity);
+        if (program->statements == NULL)
+            exit(1); // not enough memory
+    }
+    program->statements[program->count++] = statement;
+}
+
+// Stack of the nodes whose values the lifted code leaves on the VM stack
+typedef struct
+{
+    Node **nodes;
+    int count;
+    int capacity;
+    int locals; // Nodes at the bottom already declared as locals
+} NodeStack;
+
+static void pushNode(NodeStack *stack, Node *node)
+{
+    if (stack->capacity < stack->count + 1)
+    {
+        stack->capacity = stack->capacity < 8 ? 8 : stack->capacity * 2;
+        stack->nodes = realloc(stack->nodes, sizeof(Node *) * stack->capacity);
+        if (stack->nodes == NULL)
+            exit(1); // not enough memory
+    }
+    stack->nodes[stack->count++] = node;
+}
+
+static Node *popNode(NodeStack *stack)
+{
+    return stack->nodes[--stack->count];
+}
+
+// Appends a statement. Values still on the stack below it were computed before it and outlive
+// it, so they are locals: their declarations come first
+static void liftStatement(Program *program, NodeStack *stack, Node *statement)
+{
+    for (; stack->locals < stack->count; stack->locals++)
+    {
+        Node *value = stack->nodes[stack->locals];
+        Node *declaration = newNode(program, NODE_DECLARE_LOCAL, value->line);
+        declaration->slot = stack->locals;
+        declaration->left = value;
+        addStatement(program, declaration);
+    }
+    if (statement != NULL)
+        addStatement(program, statement);
+}
+
+static Node *liftUnary(Program *program, NodeType type, int line, Node *operand)
+{
+    Node *node = newNode(program, type, line);
+    node->left = operand;
+    return node;
+}
+
+static Node *liftBinary(Program *program, uint8_t op, int line, Node *left, Node *right)
+{
+    Node *node = newNode(program, NODE_BINARY, line);
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+static Node *liftVariable(Program *program, NodeType type, int line, int slot)
+{
+    Node *node = newNode(program, type, line);
+    node->slot = slot;
+    return node;
+}
+
+// 24-bit operand of the `_LONG` instruction at `code`
+static int readLong(uint8_t *code)
+{
+    return code[1] | (code[2] << 8) | (code[3] << 16);
+}
+
+static Node *liftLiteral(Program *program, int line, Value value)
+{
+    Node *node = newNode(program, NODE_LITERAL, line);
+    node->value = value;
+    return node;
+}
+
+/*
+Rebuilds the statements of `chunk`, up to its `OP_RETURN`, as trees.
+Superinstructions are split back into the nodes they fused.
+*/
+void liftChunk(Program *program, Chunk *chunk)
+{
+    NodeStack stack = {NULL, 0, 0, 0};
+    Value *constants = chunk->constants.values;
+    int run = 0;
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset)
+            run++;
+        int line = chunk->lines[run].line;
+        uint8_t *code = &chunk->code[offset];
+        uint8_t op = code[0];
+        int length = 2;
+
+        switch (op)
+        {
+        case OP_CONSTANT:
+            pushNode(&stack, liftLiteral(program, line, constants[code[1]]));
+            break;
+        case OP_CONSTANT_LONG:
+            pushNode(&stack, liftLiteral(program, line, constants[readLong(code)]));
+            length = 4;
+            break;
+        case OP_NIL:
+            pushNode(&stack, liftLiteral(program, line, NIL_VAL));
+            length = 1;
+            break;
+        case OP_TRUE:
+            pushNode(&stack, liftLiteral(program, line, BOOL_VAL(true)));
+            length = 1;
+            break;
+        case OP_FALSE:
+            pushNode(&stack, liftLiteral(program, line, BOOL_VAL(false)));
+            length = 1;
+            break;
+        case OP_NEGATE:
+        case OP_NOT:
+        {
+            Node *node = liftUnary(program, NODE_UNARY, line, popNode(&stack));
+            node->op = op;
+            pushNode(&stack, node);
+            length = 1;
+            break;
+        }
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_DIAMOND:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        {
+            Node *right = popNode(&stack);
+            Node *left = popNode(&stack);
+            pushNode(&stack, liftBinary(program, op, line, left, right));
+            length = 1;
+            break;
+        }
+        case OP_ADD_CONST:
+        {
+            Node *left = popNode(&stack);
+            pushNode(&stack, liftBinary(program, OP_ADD, line, left, liftLiteral(program, line, constants[code[1]])));
+            break;
+        }
+        case OP_GET_GLOBAL_ADD:
+        case OP_GET_LOCAL_ADD:
+        {
+            NodeType type = op == OP_GET_GLOBAL_ADD ? NODE_GET_GLOBAL : NODE_GET_LOCAL;
+            Node *left = popNode(&stack);
+            pushNode(&stack, liftBinary(program, OP_ADD, line, left, liftVariable(program, type, line, code[1])));
+            break;
+        }
+        case OP_GET_GLOBAL:
+            pushNode(&stack, liftVariable(program, NODE_GET_GLOBAL, line, code[1]));
+            break;
+        case OP_GET_GLOBAL_LONG:
+            pushNode(&stack, liftVariable(program, NODE_GET_GLOBAL, line, readLong(code)));
+            length = 4;
+            break;
+        case OP_GET_LOCAL:
+            pushNode(&stack, liftVariable(program, NODE_GET_LOCAL, line, code[1]));
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_SET_LOCAL_POP:
+        {
+            bool local = op == OP_SET_LOCAL || op == OP_SET_LOCAL_POP;
+            Node *node = liftUnary(program, local ? NODE_SET_LOCAL : NODE_SET_GLOBAL, line, popNode(&stack));
+            node->slot = op == OP_SET_GLOBAL_LONG ? readLong(code) : code[1];
+            length = op == OP_SET_GLOBAL_LONG ? 4 : 2;
+
+            if (op == OP_SET_GLOBAL_POP || op == OP_SET_LOCAL_POP)
+                liftStatement(program, &stack, liftUnary(program, NODE_EXPRESSION, line, node));
+            else
+                pushNode(&stack, node);
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        {
+            Node *node = liftUnary(program, NODE_DEFINE_GLOBAL, line, popNode(&stack));
+            node->slot = op == OP_DEFINE_GLOBAL_LONG ? readLong(code) : code[1];
+            liftStatement(program, &stack, node);
+            length = op == OP_DEFINE_GLOBAL_LONG ? 4 : 2;
+            break;
+        }
+        case OP_PRINT:
+            liftStatement(program, &stack, liftUnary(program, NODE_PRINT, line, popNode(&stack)));
+            length = 1;
+            break;
+        case OP_POP:
+            if (stack.count > stack.locals)
+                liftStatement(program, &stack, liftUnary(program, NODE_EXPRESSION, line, popNode(&stack)));
+            else
+            {
+                // The innermost local goes out of scope
+                stack.count--;
+                stack.locals--;
+                addStatement(program, liftVariable(program, NODE_DROP_LOCAL, line, stack.locals));
+            }
+            length = 1;
+            break;
+        case OP_RETURN:
+        default:
+            offset = chunk->count; // the parser emits nothing after `OP_RETURN`
+            continue;
+        }
+        offset += length;
+    }
+
+    liftStatement(program, &stack, NULL);
+    free(stack.nodes);
+}
+
+typedef struct
+{
+    Parser *parser; // Adds the literals to its constant pool
+    Chunk *chunk;
+    int lastInstruction;
+} Emitter;
+
+static void emitByte(Emitter *emitter, uint8_t byte, int line)
+{
+    writeChunk(emitter->chunk, byte, line);
+}
+
+static void emitOp(Emitter *emitter, uint8_t opcode, int line)
+{
+    if (fuseInstruction(emitter->chunk, emitter->lastInstruction, opcode, line))
+        return;
+    emitter->lastInstruction = emitter->chunk->count;
+    emitByte(emitter, opcode, line);
+}
+
+static void emitIndexed(Emitter *emitter, uint8_t op, uint8_t longOp, int operand, int line)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emitOp(emitter, op, line);
+        emitByte(emitter, (uint8_t)operand, line);
+    }
+    else
+    {
+        emitOp(emitter, longOp, line);
+        emitByte(emitter, operand & 0xff, line);
+        emitByte(emitter, (operand >> 8) & 0xff, line);
+        emitByte(emitter, (operand >> 16) & 0xff, line);
+    }
+}
+
+static void emitLocal(Emitter *emitter, uint8_t op, int slot, int line)
+{
+    emitOp(emitter, op, line);
+    emitByte(emitter, (uint8_t)slot, line);
+}
+
+static void emitNode(Emitter *emitter, Node *node)
+{
+    int line = node->line;
+    if (node->reuse)
+    {
+        emitLocal(emitter, OP_GET_LOCAL, node->temp, line);
+        return;
+    }
+
+    switch (node->type)
+    {
+    case NODE_LITERAL:
+        if (IS_NIL(node->value))
+            emitOp(emitter, OP_NIL, line);
+        else if (IS_BOOL(node->value))
+            emitOp(emitter, AS_BOOL(node->value) ? OP_TRUE : OP_FALSE, line);
+        else
+            emitIndexed(emitter, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(emitter->parser, node->value), line);
+        break;
+    case NODE_GET_LOCAL:
+        emitLocal(emitter, OP_GET_LOCAL, node->slot, line);
+        break;
+    case NODE_GET_GLOBAL:
+        emitIndexed(emitter, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, node->slot, line);
+        break;
+    case NODE_SET_LOCAL:
+        emitNode(emitter, node->left);
+        emitLocal(emitter, OP_SET_LOCAL, node->slot, line);
+        break;
+    case NODE_SET_GLOBAL:
+        emitNode(emitter, node->left);
+        emitIndexed(emitter, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, node->slot, line);
+        break;
+    case NODE_UNARY:
+        emitNode(emitter, node->left);
+        emitOp(emitter, node->op, line);
+        break;
+    case NODE_BINARY:
+        emitNode(emitter, node->left);
+        emitNode(emitter, node->right);
+        // The parser emits these as pairs, so they go through fusion the same way
+        switch (node->op)
+        {
+        case OP_NOT_EQUAL:
+            emitOp(emitter, OP_EQUAL, line);
+            emitOp(emitter, OP_NOT, line);
+            break;
+        case OP_GREATER_EQUAL:
+            emitOp(emitter, OP_LESS, line);
+            emitOp(emitter, OP_NOT, line);
+            break;
+        case OP_LESS_EQUAL:
+            emitOp(emitter, OP_GREATER, line);
+            emitOp(emitter, OP_NOT, line);
+            break;
+        default:
+            emitOp(emitter, node->op, line);
+            break;
+        }
+        break;
+    default:
+        return; // Unreachable.
+    }
+
+    if (node->temp != -1)
+        emitLocal(emitter, OP_SET_LOCAL, node->temp, line);
+}
+
+static void emitStatement(Emitter *emitter, Node *statement)
+{
+    int line = statement->line;
+    for (int i = 0; i < statement->temps; i++)
+        emitOp(emitter, OP_NIL, line);
+
+    switch (statement->type)
+    {
+    case NODE_PRINT:
+        emitNode(emitter, statement->left);
+        emitOp(emitter, OP_PRINT, line);
+        break;
+    case NODE_EXPRESSION:
+        emitNode(emitter, statement->left);
+        emitOp(emitter, OP_POP, line);
+        break;
+    case NODE_DEFINE_GLOBAL:
+        emitNode(emitter, statement->left);
+        emitIndexed(emitter, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, statement->slot, line);
+        break;
+    case NODE_DECLARE_LOCAL:
+        emitNode(emitter, statement->left);
+        break;
+    case NODE_DROP_LOCAL:
+        emitOp(emitter, OP_POP, line);
+        break;
+    default:
+        return; // Unreachable.
+    }
+
+    for (int i = 0; i < statement->temps; i++)
+        emitOp(emitter, OP_POP, line);
+}
+
+/*
+Replaces the code of `chunk` with the code of `program`. The constant pool is kept, so the
+literals of the program stay where they are.
+@return `int` - offset of the last instruction emitted, -1 if there is none
+*/
+int emitProgram(Parser *parser, Program *program, Chunk *chunk)
+{
+    Emitter emitter = {parser, chunk, -1};
+    truncateChunk(chunk, 0);
+    for (int i = 0; i < program->count; i++)
+    {
+        if (program->statements[i] != NULL)
+            emitStatement(&emitter, program->statements[i]);
+    }
+    return emitter.lastInstruction;
+}
@@ -0,0 +1,77 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "chunk.h"
+#include "parser.h"
+#include "vm.h"
+
+// Tree IR the optimiser works on (see optimizer.c).
+// Lox has no jumps, so the code the parser emits is the expression trees of each statement in
+// postfix order: `liftChunk()` rebuilds them with a symbolic stack and `emitProgram()` writes
+// them back out, peephole fusion included.
+
+typedef enum
+{
+    // Expressions
+    NODE_LITERAL,    // `value`
+    NODE_GET_LOCAL,  // `slot`
+    NODE_GET_GLOBAL, // `slot`
+    NODE_SET_LOCAL,  // `slot` = `left`, yields `left`
+    NODE_SET_GLOBAL, // `slot` = `left`, yields `left`
+    NODE_UNARY,      // `op` `left`
+    NODE_BINARY,     // `left` `op` `right`
+    // Statements
+    NODE_PRINT,          // print `left`;
+    NODE_EXPRESSION,     // `left`; with the value popped
+    NODE_DEFINE_GLOBAL,  // var `slot` = `left`; at the top level
+    NODE_DECLARE_LOCAL,  // var `slot` = `left`; in a block, the value stays on the stack as the local
+    NODE_DROP_LOCAL,     // `slot` goes out of scope
+} NodeType;
+
+typedef struct Node
+{
+    NodeType type;
+    uint8_t op;         // Opcode of unary and binary nodes. `!=`, `>=` and `<=` use their superinstructions
+    int line;
+    int slot;           // Variable slot
+    Value value;        // Always in the constant pool, so the collector keeps it alive
+    struct Node *left;  // Operand; the only one of unary nodes, assignments and statements
+    struct Node *right;
+    // Filled in by the passes
+    bool fails;         // The node's own operation may raise a runtime error
+    bool mayFail;       // The node or any of its operands may
+    int temp;           // Hidden local the value is saved to for reuse, -1 if none
+    bool reuse;         // Loads `temp` instead of being evaluated again
+    bool skipped;       // Inside a reused subtree, so never emitted
+    int temps;          // Statements: hidden locals pushed before and popped after
+} Node;
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[]; // 8-byte aligned after the three fields above
+} ArenaBlock;
+
+// Bump allocator: nodes are never freed one by one, only all together with their program
+typedef struct
+{
+    ArenaBlock *blocks;
+} Arena;
+
+typedef struct
+{
+    Arena arena;
+    Node **statements; // In execution order, NULL once removed by a pass
+    int count;
+    int capacity;
+} Program;
+
+void initProgram(Program *program);
+void freeProgram(Program *program);
+Node *newNode(Program *program, NodeType type, int line);
+void liftChunk(Program *program, Chunk *chunk);
+int emitProgram(Parser *parser, Program *program, Chunk *chunk);
+
+#endif
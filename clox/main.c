@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "build.h"
 #include "common.h"
+#include "compiler.h"
+#include "file.h"
+#include "image.h"
 #include "vm.h"
 
 static void repl(VM *vm)
@@ -22,91 +26,191 @@ static void repl(VM *vm)
     }
 }
 
-static FILE *openFile(const char *path)
+static void readFile(const char *path, MappedFile *file)
 {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL)
+    if (!mapFile(path, file))
     {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
-    return file;
 }
 
-static size_t getFileSize(FILE *file)
+static bool hasSuffix(const char *string, const char *suffix)
 {
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-    return fileSize;
+    size_t length = strlen(string);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength && strcmp(string + length - suffixLength, suffix) == 0;
 }
 
-static char *getFileBuffer(FILE *file, const char *path)
+// Maps the image file at `path` into `image` and loads it; if `source` isn't NULL, only if it was
+// compiled from exactly that. The chunk may run its code straight from `image`, which stays mapped
+// until the chunk is freed
+static bool loadImage(VM *vm, const char *path, const MappedFile *source, MappedFile *image, Chunk *chunk)
 {
-    size_t fileSize = getFileSize(file);
-    char *buffer = (char *)malloc(fileSize + 1);
-    if (buffer == NULL)
+    if (source == NULL)
+        readFile(path, image);
+    else if (!mapFile(path, image))
+        return false;
+
+    const uint8_t *bytes = (const uint8_t *)image->bytes;
+    uint64_t sourceHash;
+    bool loaded = readImageHash(bytes, image->size, &sourceHash) &&
+                  (source == NULL || sourceHash == hashSource(source->bytes, source->size)) &&
+                  readImage(vm, bytes, image->size, chunk, true);
+    if (!loaded)
+        unmapFile(image);
+    return loaded;
+}
+
+static void runFile(VM *vm, const char *path)
+{
+    InterpretResult result;
+    Chunk chunk;
+    initChunk(&chunk);
+    MappedFile image;
+
+    if (hasSuffix(path, ".loxc"))
     {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        if (!loadImage(vm, path, NULL, &image, &chunk))
+        {
+            fprintf(stderr, "Could not load image \"%s\".\n", path);
+            exit(65);
+        }
+        result = interpretChunk(vm, &chunk);
+        releaseChunk(vm, &chunk);
+        unmapFile(&image);
     }
-    return buffer;
+    else
+    {
+        MappedFile source;
+        readFile(path, &source);
+        char *cachePath = imagePath(path);
+        // A cached image skips compilation, as long as the source hasn't changed since.
+        // -O and -T ask for a compilation of their own, so they bypass it
+        bool useCache = !vm->optimize && !vm->bufferTokens;
+        if (useCache && loadImage(vm, cachePath, &source, &image, &chunk))
+        {
+            result = interpretChunk(vm, &chunk);
+            releaseChunk(vm, &chunk);
+            unmapFile(&image);
+        }
+        else
+        {
+            result = interpret(vm, source.bytes);
+        }
+        free(cachePath);
+        unmapFile(&source);
+    }
+
+    if (result == INTERPRET_COMPILE_ERROR)
+        exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR)
+        exit(70);
 }
 
-static size_t readWholeBuffer(char *buffer, size_t typeSize, FILE *file, const char *path)
+// Compiles the source at `path` and saves it as an image to `output`, without running it
+static void compileFile(VM *vm, const char *path, const char *output)
 {
-    size_t fileSize = getFileSize(file);
-    size_t bytesRead = fread(buffer, typeSize, fileSize, file);
-    if (bytesRead < fileSize)
+    MappedFile source;
+    readFile(path, &source);
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compile(vm, source.bytes, &chunk))
+        exit(65);
+
+    if (!saveImage(vm, &chunk, hashSource(source.bytes, source.size), output))
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        fprintf(stderr, "Could not write image \"%s\".\n", output);
         exit(74);
     }
-    return bytesRead;
+
+    releaseChunk(vm, &chunk);
+    unmapFile(&source);
 }
 
-static char *readFile(const char *path)
+static void usage()
 {
-    FILE *file = openFile(path);
-    char *buffer = getFileBuffer(file, path);
-    size_t bytesRead = readWholeBuffer(buffer, sizeof(char), file, path);
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
+    fprintf(stderr, "Usage: clox [-O] [-T] [path]\n");
+    fprintf(stderr, "       clox [-O] [-T] --compile path -o output\n");
+    fprintf(stderr, "       clox build [-O] [-T] [-j jobs] path...\n");
+    exit(64);
 }
 
-static void runFile(VM *vm, const char *path)
+// `clox build`: compiles scripts, and the `.lox` files of directories, to images in parallel
+static int build(int argc, const char *argv[])
 {
-    char *source = readFile(path);
-    InterpretResult result = interpret(vm, source);
-    free(source);
+    BuildOptions options = {0, false, false};
+    const char **paths = malloc(sizeof(const char *) * argc);
+    if (paths == NULL)
+        exit(1); // not enough memory
+    int pathCount = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-O") == 0)
+            options.optimize = true;
+        else if (strcmp(argv[i], "-T") == 0)
+            options.bufferTokens = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            options.jobs = atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            paths[pathCount++] = argv[i];
+        else
+            usage();
+    }
+    if (pathCount == 0)
+        usage();
 
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+    int status = buildImages(paths, pathCount, &options);
+    free(paths);
+    return status;
 }
 
 int main(int argc, const char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "build") == 0)
+        return build(argc - 2, argv + 2);
+
     VM vm;
     initVM(&vm);
 
-    if (argc == 1)
+    const char *path = NULL;
+    const char *compilePath = NULL;
+    const char *output = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        repl(&vm);
+        if (strcmp(argv[i], "-O") == 0)
+            vm.optimize = true;
+        else if (strcmp(argv[i], "-T") == 0)
+            vm.bufferTokens = true;
+        else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc && compilePath == NULL)
+            compilePath = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && output == NULL)
+            output = argv[++i];
+        else if (argv[i][0] != '-' && path == NULL)
+            path = argv[i];
+        else
+            usage();
+    }
+
+    if (compilePath != NULL)
+    {
+        if (output == NULL || path != NULL)
+            usage();
+        compileFile(&vm, compilePath, output);
     }
-    else if (argc == 2)
+    else if (output != NULL)
     {
-        runFile(&vm, argv[1]);
+        usage();
+    }
+    else if (path == NULL)
+    {
+        repl(&vm);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(&vm, path);
     }
 
     freeVM(&vm);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,9 +1,54 @@
+#include <limits.h>
 #include <stdlib.h>
 
 #include "memory.h"
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#include "debug.h"
+#endif
+
+// The VM whose heap `reallocate()` accounts to and collects. One per thread, so VMs on
+// different threads each keep their own. Every call taking a VM makes it current while it runs,
+// so several VMs can share a thread too
+static _Thread_local VM *heapVM = NULL;
+
+// Makes `vm` the heap of this thread
+// @return `VM*` - the VM that was, for the caller to restore
+VM *setHeapVM(VM *vm)
+{
+    VM *previous = heapVM;
+    heapVM = vm;
+    return previous;
+}
+
+#ifdef INCREMENTAL_GC
+static void collectStep(VM *vm);
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
+    if (heapVM != NULL)
+    {
+        heapVM->bytesAllocated += newSize - oldSize;
+        if (newSize > oldSize)
+        {
+#ifdef DEBUG_STRESS_GC
+            collectGarbage(heapVM);
+#endif
+#ifdef INCREMENTAL_GC
+            if (heapVM->gcPhase == GC_IDLE ? heapVM->bytesAllocated > heapVM->nextGC
+                                           : heapVM->bytesAllocated > heapVM->nextGCStep)
+                collectStep(heapVM);
+#else
+            if (heapVM->bytesAllocated > heapVM->nextGC)
+                collectGarbage(heapVM);
+#endif
+        }
+
+        return poolReallocate(&heapVM->allocator, pointer, oldSize, newSize);
+    }
+
     if (newSize == 0)
     {
         free(pointer);
@@ -18,21 +63,247 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 
 static void freeObject(Obj *object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+
     switch (object->type)
     {
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        reallocate(object, STRING_SIZE(string->length), 0);
         break;
     }
+    case OBJ_ROPE:
+        FREE(ObjRope, object);
+        break;
     }
 }
 
+void markObject(VM *vm, Obj *object)
+{
+    if (object == NULL || object->isMarked)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = true;
+
+    if (vm->grayCapacity < vm->grayCount + 1)
+    {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        // Plain `realloc`, so growing the gray stack never starts a nested collection
+        vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+        if (vm->grayStack == NULL)
+            exit(1); // not enough memory
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM *vm, Value value)
+{
+    if (IS_OBJ(value))
+        markObject(vm, AS_OBJ(value));
+}
+
+void markArray(VM *vm, ValueArray *array)
+{
+    for (int i = 0; i < array->count; i++)
+        markValue(vm, array->values[i]);
+}
+
+/*
+Keeps `object` alive through the collection in progress. Called when the mutator picks an
+object up from the weak intern table, which is the only way it can reach a white object that
+was never traced. While sweeping only the mark bit is set: interned strings have no references.
+*/
+void shadeObject(VM *vm, Obj *object)
+{
+    if (vm->gcPhase == GC_MARK)
+        markObject(vm, object);
+    else if (vm->gcPhase == GC_SWEEP)
+        object->isMarked = true;
+}
+
+// Marks everything an object references, turning it from gray to black
+static void blackenObject(VM *vm, Obj *object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void *)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    switch (object->type)
+    {
+    case OBJ_STRING:
+        break; // strings hold no references
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        markObject(vm, rope->left);
+        markObject(vm, rope->right);
+        markObject(vm, (Obj *)rope->flat);
+        break;
+    }
+    }
+}
+
+// Marks up to `*budget` values of `array` starting at `*cursor`
+// @return `bool` - was the whole array marked
+static bool markArrayFrom(VM *vm, ValueArray *array, int *cursor, int *budget)
+{
+    while (*cursor < array->count)
+    {
+        if (*budget <= 0)
+            return false;
+        markValue(vm, array->values[(*cursor)++]);
+        (*budget)--;
+    }
+    return true;
+}
+
+static bool traceReferences(VM *vm, int *budget)
+{
+    while (vm->grayCount > 0)
+    {
+        if (*budget <= 0)
+            return false;
+        Obj *object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
+        (*budget)--;
+    }
+    return true;
+}
+
+static void beginCycle(VM *vm)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    vm->gcPhase = GC_MARK;
+    vm->namesCursor = 0;
+    vm->valuesCursor = 0;
+    vm->constantsCursor = 0;
+}
+
+/*
+Marks roots and traces gray objects. Global slots and constant pools only ever grow, so they are
+scanned with cursors across steps; overwritten global values go through `WRITE_BARRIER` in the VM.
+The keys of `globalSlots` are the strings in `globalNames`. The stack changes constantly and is
+small, so it is scanned once, atomically, at the end.
+@return `bool` - is marking finished
+*/
+static bool markStep(VM *vm, int *budget)
+{
+    ValueArray *constants = vm->chunk != NULL ? &vm->chunk->constants : NULL;
+
+    if (!markArrayFrom(vm, &vm->globalNames, &vm->namesCursor, budget) ||
+        !markArrayFrom(vm, &vm->globalValues, &vm->valuesCursor, budget) ||
+        (constants != NULL && !markArrayFrom(vm, constants, &vm->constantsCursor, budget)) ||
+        !traceReferences(vm, budget))
+        return false;
+
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
+        markValue(vm, *slot);
+    int unbounded = INT_MAX;
+    traceReferences(vm, &unbounded);
+
+    vm->gcPhase = GC_SWEEP;
+    vm->sweepLink = &vm->objects;
+    return true;
+}
+
+static void endCycle(VM *vm)
+{
+    if (vm->sweepNewObjects != NULL)
+    {
+        vm->sweepNewTail->next = vm->objects;
+        vm->objects = vm->sweepNewObjects;
+        vm->sweepNewObjects = NULL;
+        vm->sweepNewTail = NULL;
+    }
+
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm->nextGC < GC_INITIAL_THRESHOLD)
+        vm->nextGC = GC_INITIAL_THRESHOLD;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes in use, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+// Frees up to `*budget` unmarked objects and clears the mark of the survivors
+// @return `bool` - is sweeping finished
+static bool sweepStep(VM *vm, int *budget)
+{
+    while (*vm->sweepLink != NULL)
+    {
+        if (*budget <= 0)
+            return false;
+        (*budget)--;
+
+        Obj *object = *vm->sweepLink;
+        if (object->isMarked)
+        {
+            object->isMarked = false; // white again for the next collection
+            vm->sweepLink = &object->next;
+            continue;
+        }
+
+        *vm->sweepLink = object->next;
+        if (object->type == OBJ_STRING)
+            tableDelete(&vm->strings, (ObjString *)object); // interned strings don't keep themselves alive
+        freeObject(object);
+    }
+
+    endCycle(vm);
+    return true;
+}
+
+// Advances the collection by at most `budget` units of work, starting a new cycle if none is running
+static void collect(VM *vm, int budget)
+{
+    if (vm->gcPhase == GC_IDLE)
+        beginCycle(vm);
+
+    if (vm->gcPhase == GC_MARK && !markStep(vm, &budget))
+        return;
+    sweepStep(vm, &budget);
+}
+
+#ifdef INCREMENTAL_GC
+// One bounded pause of the incremental collector
+static void collectStep(VM *vm)
+{
+    collect(vm, vm->gcStepBudget);
+    vm->nextGCStep = vm->bytesAllocated + GC_STEP_BYTES;
+}
+#endif
+
+// Frees every object that is unreachable from the VM or the compiler, without interruption
+void collectGarbage(VM *vm)
+{
+    if (vm->gcPhase != GC_IDLE)
+        collect(vm, INT_MAX); // finish the cycle in progress first; it may have missed recent garbage
+    collect(vm, INT_MAX);
+}
+
 // Frees all user-defined objects.
 void freeObjects(VM *vm)
 {
+    if (vm->sweepNewObjects != NULL)
+    {
+        vm->sweepNewTail->next = vm->objects;
+        vm->objects = vm->sweepNewObjects;
+    }
+
     Obj *object = vm->objects;
     while (object != NULL)
     {
@@ -40,4 +311,6 @@ void freeObjects(VM *vm)
         freeObject(object);
         object = next;
     }
-}
+
+    free(vm->grayStack);
+}
\ No newline at end of file
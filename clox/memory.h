@@ -10,8 +10,9 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// Doubling keeps every capacity a power of two, which `Table` relies on for mask indexing
 #define GROW_CAPACITY(capacity) \
-    ((capacity) < 8 ? 8 : (capacity) * 1.5)
+    ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount)      \
     (type *)reallocate(pointer, sizeof(type) * (oldCount), \
@@ -20,7 +21,23 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+#define GC_HEAP_GROW_FACTOR 2
+
+#ifndef GC_STEP_BUDGET
+#define GC_STEP_BUDGET 1024 // Default `vm->gcStepBudget`; bounds the work of one incremental pause
+#endif
+#define GC_STEP_BYTES (16 * 1024) // Allocation between two incremental steps
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+VM *setHeapVM(VM *vm);
+void markObject(VM *vm, Obj *object);
+void markValue(VM *vm, Value value);
+void markArray(VM *vm, ValueArray *array);
+void shadeObject(VM *vm, Obj *object);
+void collectGarbage(VM *vm);
 void freeObjects(VM *vm);
 
 #endif
\ No newline at end of file
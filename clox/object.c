@@ -1,35 +1,50 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "intern.h"
 #include "memory.h"
 #include "table.h"
 #include "object.h"
 
-#define ALLOCATE_OBJ(vm, type, objectType) \
-    (type *)allocateObject(vm, sizeof(type), objectType)
-
-// Return an `Obj` of certain type from an array of bytes in heap
-static Obj *allocateObject(VM *vm, size_t size, ObjType type)
+// Puts a freshly allocated `object` under the garbage collector's management
+static Obj *linkObject(VM *vm, Obj *object, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
     object->type = type;
+    // Objects born while marking are black: whatever they reference is already reachable
+    object->isMarked = vm->gcPhase == GC_MARK;
+
+    if (vm->gcPhase == GC_SWEEP)
+    {
+        // Kept off the list being swept, and white for the next cycle
+        if (vm->sweepNewObjects == NULL)
+            vm->sweepNewTail = object;
+        object->next = vm->sweepNewObjects;
+        vm->sweepNewObjects = object;
+        return object;
+    }
 
     object->next = vm->objects;
     vm->objects = object;
     return object;
 }
 
-// Returns a `string object` from an array of bytes in heap
-static ObjString *allocateString(VM *vm, char *chars, int length, uint32_t hash)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type *)linkObject(vm, (Obj *)reallocate(NULL, 0, sizeof(type)), objectType)
+
+// Links `string` into the object list and the intern table
+static ObjString *internString(VM *vm, ObjString *string, uint32_t hash)
 {
-    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    linkObject(vm, (Obj *)string, OBJ_STRING);
+
+    push(vm, OBJ_VAL(string)); // growing the intern table may trigger a collection
     tableSet(&vm->strings, string, NIL_VAL); // string intern
+    pop(vm);
     return string;
 }
 
+#ifdef FNV_HASH
 // https://github.com/lcn2/fnv
 static uint32_t hashString(const char *key, int length)
 {
@@ -41,34 +56,186 @@ static uint32_t hashString(const char *key, int length)
     }
     return hash;
 }
+#else
+// Folds one 64-bit word into the running hash
+static inline uint64_t hashWord(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+    return hash ^ (hash >> 32);
+}
 
-// Takes ownership of preallocated `ObjString` on heap.
-// @return Pointer to `ObjString`'s first character
-ObjString *takeString(VM *vm, char *chars, int length)
+// Word-at-a-time hash: eight characters per multiply instead of FNV-1a's one,
+// finished with the MurmurHash3 mixer so the low bits used for bucket selection are well spread
+static uint32_t hashString(const char *key, int length)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    uint64_t hash = (uint64_t)length * 0x9e3779b97f4a7c15u;
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, key + i, 8); // unaligned load
+        hash = hashWord(hash, word);
+    }
+    if (i < length)
+    {
+        uint64_t word = 0;
+        memcpy(&word, key + i, length - i);
+        hash = hashWord(hash, word);
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+#endif
+
+// Returns an unlinked string with room for `length` characters, for the caller to fill in and
+// hand to `takeString()`. The collector doesn't see it until then, so it must not be kept across one
+ObjString *allocateString(int length)
+{
+    ObjString *string = (ObjString *)reallocate(NULL, 0, STRING_SIZE(length));
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Takes ownership of a string filled in after `allocateString()`.
+// Frees it and returns the interned copy if there is one
+ObjString *takeString(VM *vm, ObjString *string)
+{
+    uint32_t hash = hashString(string->chars, string->length);
+    if (vm->sharedStrings != NULL)
+    {
+        ObjString *shared = internShared(vm->sharedStrings, string->chars, string->length, hash);
+        reallocate(string, STRING_SIZE(string->length), 0);
+        return shared;
+    }
+
+    ObjString *interned = tableFindString(&vm->strings, string->chars, string->length, hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        reallocate(string, STRING_SIZE(string->length), 0);
+        shadeObject(vm, (Obj *)interned);
         return interned;
     }
-    return allocateString(vm, chars, length, hash);
+    return internString(vm, string, hash);
 }
 
 // Copies `ObjString` to heap if it was not interned. Returns pointer to interned string otherwise
 ObjString *copyString(VM *vm, const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+    if (vm->sharedStrings != NULL)
+        return internShared(vm->sharedStrings, chars, length, hash);
 
+    ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL)
+    {
+        shadeObject(vm, (Obj *)interned);
         return interned;
+    }
+
+    ObjString *string = allocateString(length); // header and characters in one block
+    memcpy(string->chars, chars, length);
+    return internString(vm, string, hash);
+}
+
+ObjRope *newRope(VM *vm, Obj *left, Obj *right)
+{
+    // Flattened operands are referenced through their string, so their rope can be collected
+    if (left->type == OBJ_ROPE && ((ObjRope *)left)->flat != NULL)
+        left = (Obj *)((ObjRope *)left)->flat;
+    if (right->type == OBJ_ROPE && ((ObjRope *)right)->flat != NULL)
+        right = (Obj *)((ObjRope *)right)->flat;
+
+    ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = textLength(left) + textLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
 
-    char *heapChars = ALLOCATE(char, length + 1);       // get free space
-    memcpy(heapChars, chars, length);                   // copy characters from current array to new space
-    heapChars[length] = '\0';                           // add null character at the end
-    return allocateString(vm, heapChars, length, hash); // get 'string object' representation of allocated memory
+    // Born black while marking, so its children must not stay white
+    if (vm->gcPhase == GC_MARK)
+    {
+        markObject(vm, left);
+        markObject(vm, right);
+    }
+    return rope;
+}
+
+typedef void (*LeafVisitor)(ObjString *leaf, void *context);
+
+// Calls `visit` on every string of `rope`, left to right.
+// Ropes built in a loop are as deep as the loop is long, so the walk keeps its own stack
+static void walkRope(ObjRope *rope, LeafVisitor visit, void *context)
+{
+    int capacity = 64;
+    int count = 0;
+    Obj **stack = malloc(sizeof(Obj *) * capacity); // not `reallocate()`: a walk must not trigger a collection
+    if (stack == NULL)
+        exit(1); // not enough memory
+    stack[count++] = (Obj *)rope;
+
+    while (count > 0)
+    {
+        Obj *node = stack[--count];
+        if (node->type == OBJ_STRING)
+        {
+            visit((ObjString *)node, context);
+            continue;
+        }
+
+        ObjRope *inner = (ObjRope *)node;
+        if (inner->flat != NULL)
+        {
+            visit(inner->flat, context);
+            continue;
+        }
+        if (count + 2 > capacity)
+        {
+            capacity *= 2;
+            stack = realloc(stack, sizeof(Obj *) * capacity);
+            if (stack == NULL)
+                exit(1); // not enough memory
+        }
+        stack[count++] = inner->right;
+        stack[count++] = inner->left;
+    }
+
+    free(stack);
+}
+
+static void appendLeaf(ObjString *leaf, void *context)
+{
+    char **cursor = context;
+    memcpy(*cursor, leaf->chars, leaf->length);
+    *cursor += leaf->length;
+}
+
+static void printLeaf(ObjString *leaf, void *context)
+{
+    (void)context;
+    fwrite(leaf->chars, 1, leaf->length, stdout);
+}
+
+// Copies the characters of `rope` into one interned string, once.
+// `rope` must stay reachable (e.g. on the VM stack) while this allocates
+ObjString *flattenRope(VM *vm, ObjRope *rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    ObjString *string = allocateString(rope->length);
+    char *cursor = string->chars;
+    walkRope(rope, appendLeaf, &cursor);
+
+    // An interned copy found by `takeString()` is shaded, and a new one is born black while marking,
+    // so storing it into a black rope keeps the tri-color invariant
+    rope->flat = takeString(vm, string);
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
 }
 
 // Prints an `Obj` representation to stdout
@@ -79,5 +246,8 @@ void printObject(Value value)
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
+    case OBJ_ROPE:
+        walkRope(AS_ROPE(value), printLeaf, NULL); // printing doesn't need the flat copy
+        break;
     }
 }
\ No newline at end of file
@@ -8,18 +8,23 @@
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value)) // anything `+` can concatenate
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum
 {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct Obj
 {
     ObjType type;
+    bool isMarked;    // Reached during the current garbage collection
     struct Obj *next; // Intrusive list pointer, for Garbage Collector
 };
 
@@ -27,12 +32,32 @@ struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char chars[]; // `length` characters and a terminating '\0', stored inline
 };
 
-ObjString *takeString(VM *vm, char *chars, int length);
+// Bytes taken by an `ObjString` of `length` characters
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Concatenations shorter than this are copied into a flat string right away
+#define ROPE_MIN_LENGTH 64
+
+// Lazy concatenation of two `ObjString`s or `ObjRope`s.
+// Characters are only copied and interned when the value is compared (see `flattenRope()`)
+typedef struct
+{
+    Obj obj;
+    int length;
+    Obj *left;       // NULL once flattened
+    Obj *right;      // NULL once flattened
+    ObjString *flat; // Interned contents, set by the first `flattenRope()`
+} ObjRope;
+
+ObjString *allocateString(int length);
+ObjString *takeString(VM *vm, ObjString *string);
 ObjString *copyString(VM *vm, const char *chars, int length);
+ObjRope *newRope(VM *vm, Obj *left, Obj *right);
+ObjString *flattenRope(VM *vm, ObjRope *rope);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type)
@@ -40,4 +65,10 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Length of an `ObjString` or `ObjRope`
+static inline int textLength(Obj *text)
+{
+    return text->type == OBJ_STRING ? ((ObjString *)text)->length : ((ObjRope *)text)->length;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,637 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "object.h"
+#include "optimizer.h"
+#include "parser.h"
+
+/*
+Optimiser run on each chunk when the VM is started with -O: the chunk is lifted into the tree IR
+(see ir.h), rewritten by the passes below and emitted again.
+Lox code has no jumps, so every pass is a single walk over the statements in order or in reverse.
+The passes only remove work: a runtime error is raised by the same operation, with the same
+message and line, as without them.
+*/
+
+// Evaluates a unary operator on a literal like the VM would. Operands it would reject aren't folded
+bool foldUnary(uint8_t op, Value operand, Value *result)
+{
+    switch (op)
+    {
+    case OP_NOT:
+        *result = BOOL_VAL(isFalsey(operand));
+        return true;
+    case OP_NEGATE:
+        if (!IS_NUMBER(operand))
+            return false;
+        *result = NUMBER_VAL(-AS_NUMBER(operand));
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+Evaluates a binary operator on two literals exactly like the VM would.
+Operands the VM would reject are not folded, so the error still happens at runtime, on its line.
+A concatenated string isn't referenced by anything yet: the caller must add it to the constant pool.
+@return `bool` - was the operator folded into `result`
+*/
+bool foldBinary(VM *vm, uint8_t op, Value a, Value b, Value *result)
+{
+    switch (op)
+    {
+    case OP_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case OP_NOT_EQUAL:
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    case OP_ADD:
+        if (IS_STRING(a) && IS_STRING(b))
+        {
+            // Both operands are in the constant pool, so a collection can't free them here
+            ObjString *left = AS_STRING(a);
+            ObjString *right = AS_STRING(b);
+            if (left->length > INT_MAX - right->length)
+                break; // "String too long." at runtime
+            ObjString *string = allocateString(left->length + right->length);
+            memcpy(string->chars, left->chars, left->length);
+            memcpy(string->chars + left->length, right->chars, right->length);
+            *result = OBJ_VAL(takeString(vm, string));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op)
+    {
+    case OP_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case OP_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case OP_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case OP_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    case OP_DIAMOND:
+        *result = NUMBER_VAL(diamond(x, y));
+        return true;
+    case OP_ADD:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case OP_SUBTRACT:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case OP_MULTIPLY:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case OP_DIVIDE:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void makeLiteral(Node *node, Value value)
+{
+    node->type = NODE_LITERAL;
+    node->value = value;
+    node->left = NULL;
+    node->right = NULL;
+    node->fails = false;
+    node->mayFail = false;
+}
+
+// Does evaluating `node` write any variable
+static bool hasStores(Node *node)
+{
+    if (node == NULL)
+        return false;
+    if (node->type == NODE_SET_LOCAL || node->type == NODE_SET_GLOBAL)
+        return true;
+    return hasStores(node->left) || hasStores(node->right);
+}
+
+// Constant propagation
+
+typedef enum
+{
+    GLOBAL_UNKNOWN, // May still be undefined: reading or assigning it can fail
+    GLOBAL_DEFINED, // Defined by this chunk, value unknown
+    GLOBAL_KNOWN,   // Defined by this chunk, holds `globals[slot]`
+} GlobalState;
+
+typedef struct
+{
+    Parser *parser; // Its constant pool roots the strings that folding creates
+    Value locals[UINT8_COUNT];
+    bool localKnown[UINT8_COUNT];
+    Value *globals;
+    uint8_t *globalStates; // `GlobalState` by slot
+} Propagation;
+
+static void storeLocal(Propagation *propagation, int slot, Node *value)
+{
+    propagation->localKnown[slot] = value->type == NODE_LITERAL;
+    propagation->locals[slot] = value->value;
+}
+
+// Code after a store only runs if the store succeeded, so from there on the global is defined
+static void storeGlobal(Propagation *propagation, int slot, Node *value)
+{
+    bool known = value->type == NODE_LITERAL;
+    propagation->globalStates[slot] = known ? GLOBAL_KNOWN : GLOBAL_DEFINED;
+    propagation->globals[slot] = value->value;
+}
+
+// Replaces reads of variables holding a literal by the literal, folds operators on literals
+// and works out which operations can still fail
+static void propagate(Propagation *propagation, Node *node)
+{
+    Value result;
+    switch (node->type)
+    {
+    case NODE_LITERAL:
+        return;
+    case NODE_GET_LOCAL:
+        if (propagation->localKnown[node->slot])
+            makeLiteral(node, propagation->locals[node->slot]);
+        return;
+    case NODE_GET_GLOBAL:
+        if (propagation->globalStates[node->slot] == GLOBAL_KNOWN)
+            makeLiteral(node, propagation->globals[node->slot]);
+        else
+            node->fails = node->mayFail = propagation->globalStates[node->slot] == GLOBAL_UNKNOWN;
+        return;
+    case NODE_SET_LOCAL:
+        propagate(propagation, node->left);
+        node->mayFail = node->left->mayFail;
+        storeLocal(propagation, node->slot, node->left);
+        return;
+    case NODE_SET_GLOBAL:
+        propagate(propagation, node->left);
+        node->fails = propagation->globalStates[node->slot] == GLOBAL_UNKNOWN;
+        node->mayFail = node->fails || node->left->mayFail;
+        storeGlobal(propagation, node->slot, node->left);
+        return;
+    case NODE_UNARY:
+        propagate(propagation, node->left);
+        if (node->left->type == NODE_LITERAL && foldUnary(node->op, node->left->value, &result))
+        {
+            makeLiteral(node, result);
+            return;
+        }
+        node->fails = node->op != OP_NOT;
+        node->mayFail = node->fails || node->left->mayFail;
+        return;
+    case NODE_BINARY:
+        propagate(propagation, node->left);
+        propagate(propagation, node->right);
+        if (node->left->type == NODE_LITERAL && node->right->type == NODE_LITERAL &&
+            foldBinary(propagation->parser->vm, node->op, node->left->value, node->right->value, &result))
+        {
+            if (IS_OBJ(result))
+                makeConstant(propagation->parser, result); // roots the concatenated string
+            makeLiteral(node, result);
+            return;
+        }
+        node->fails = node->op != OP_EQUAL && node->op != OP_NOT_EQUAL;
+        node->mayFail = node->fails || node->left->mayFail || node->right->mayFail;
+        return;
+    default:
+        return; // Unreachable.
+    }
+}
+
+static void propagateConstants(Parser *parser, Program *program)
+{
+    Propagation propagation;
+    propagation.parser = parser;
+    memset(propagation.localKnown, 0, sizeof(propagation.localKnown));
+    int globalCount = parser->vm->globalValues.count;
+    propagation.globals = malloc(sizeof(Value) * (globalCount + 1));
+    propagation.globalStates = calloc(globalCount + 1, sizeof(uint8_t));
+    if (propagation.globals == NULL || propagation.globalStates == NULL)
+        exit(1); // not enough memory
+
+    for (int i = 0; i < program->count; i++)
+    {
+        Node *statement = program->statements[i];
+        if (statement->left != NULL)
+            propagate(&propagation, statement->left);
+
+        switch (statement->type)
+        {
+        case NODE_DEFINE_GLOBAL:
+            storeGlobal(&propagation, statement->slot, statement->left);
+            break;
+        case NODE_DECLARE_LOCAL:
+            storeLocal(&propagation, statement->slot, statement->left);
+            break;
+        case NODE_DROP_LOCAL:
+            propagation.localKnown[statement->slot] = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    free(propagation.globals);
+    free(propagation.globalStates);
+}
+
+// Dead code elimination
+
+typedef enum
+{
+    STORE_NONE,
+    STORE_SET,    // Assigned
+    STORE_DEFINE, // Defined again by `var`
+} Store;
+
+/*
+State of the backward walk. A local is live if it may be read before it is written or dropped.
+A global store is dead if the global is written again before anything reads it. Globals outlive
+the chunk, and are still visible after a runtime error, so that only holds if nothing in between
+can fail: every operation that may fail starts a new `epoch`, which forgets every pending store.
+*/
+typedef struct
+{
+    bool live[UINT8_COUNT];
+    int epoch;
+    int *storeEpochs; // `epoch` in which `nextStores[slot]` was recorded
+    uint8_t *nextStores;
+} Liveness;
+
+static Store nextStore(Liveness *liveness, int slot)
+{
+    if (liveness->storeEpochs[slot] != liveness->epoch)
+        return STORE_NONE;
+    return liveness->nextStores[slot];
+}
+
+static void recordStore(Liveness *liveness, int slot, Store store)
+{
+    liveness->storeEpochs[slot] = liveness->epoch;
+    liveness->nextStores[slot] = store;
+}
+
+// Applies the effects of `node` and its operands in reverse evaluation order
+static void visitBackward(Liveness *liveness, Node *node)
+{
+    if (node->fails)
+        liveness->epoch++;
+
+    switch (node->type)
+    {
+    case NODE_GET_LOCAL:
+        liveness->live[node->slot] = true;
+        break;
+    case NODE_GET_GLOBAL:
+        recordStore(liveness, node->slot, STORE_NONE);
+        break;
+    case NODE_SET_LOCAL:
+        liveness->live[node->slot] = false;
+        break;
+    case NODE_SET_GLOBAL:
+        if (!node->fails)
+            recordStore(liveness, node->slot, STORE_SET);
+        break;
+    default:
+        break;
+    }
+
+    if (node->right != NULL)
+        visitBackward(liveness, node->right);
+    if (node->left != NULL)
+        visitBackward(liveness, node->left);
+}
+
+// Strips assignments nothing observes off the top of an expression statement
+static Node *removeDeadStores(Liveness *liveness, Node *value)
+{
+    for (;;)
+    {
+        if (value->type == NODE_SET_LOCAL && !liveness->live[value->slot])
+            value = value->left;
+        else if (value->type == NODE_SET_GLOBAL && !value->fails && nextStore(liveness, value->slot) != STORE_NONE)
+            value = value->left;
+        else
+            return value;
+    }
+}
+
+static void eliminateDeadCode(VM *vm, Program *program)
+{
+    Liveness liveness;
+    memset(liveness.live, 0, sizeof(liveness.live));
+    liveness.epoch = 1;
+    int globalCount = vm->globalValues.count;
+    liveness.storeEpochs = calloc(globalCount + 1, sizeof(int));
+    liveness.nextStores = calloc(globalCount + 1, sizeof(uint8_t));
+    if (liveness.storeEpochs == NULL || liveness.nextStores == NULL)
+        exit(1); // not enough memory
+
+    for (int i = program->count - 1; i >= 0; i--)
+    {
+        Node *statement = program->statements[i];
+        switch (statement->type)
+        {
+        case NODE_DROP_LOCAL:
+            liveness.live[statement->slot] = false;
+            continue;
+        case NODE_DECLARE_LOCAL:
+            // The slot must still be pushed, but a value nobody reads needn't be computed
+            if (!liveness.live[statement->slot] && statement->left->type != NODE_LITERAL &&
+                !statement->left->mayFail && !hasStores(statement->left))
+                makeLiteral(statement->left, NIL_VAL);
+            liveness.live[statement->slot] = false;
+            break;
+        case NODE_DEFINE_GLOBAL:
+            if (nextStore(&liveness, statement->slot) != STORE_DEFINE)
+            {
+                recordStore(&liveness, statement->slot, STORE_DEFINE);
+                break;
+            }
+            statement->type = NODE_EXPRESSION; // defined again before anything reads it
+            // fallthrough
+        case NODE_EXPRESSION:
+            statement->left = removeDeadStores(&liveness, statement->left);
+            if (!statement->left->mayFail && !hasStores(statement->left))
+            {
+                program->statements[i] = NULL;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+        visitBackward(&liveness, statement->left);
+    }
+
+    free(liveness.storeEpochs);
+    free(liveness.nextStores);
+
+    // Close the gaps left by removed statements
+    int count = 0;
+    for (int i = 0; i < program->count; i++)
+    {
+        if (program->statements[i] != NULL)
+            program->statements[count++] = program->statements[i];
+    }
+    program->count = count;
+}
+
+// Common subexpression elimination
+
+typedef struct
+{
+    Node *node;
+    uint32_t hash;
+    int size;  // Nodes in the subtree, about the instructions it compiles to
+    int order; // Position in evaluation order
+} Candidate;
+
+typedef struct
+{
+    Candidate *items;
+    int count;
+    int capacity;
+} Candidates;
+
+static uint64_t literalBits(Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        // Bitwise, so `0` and `-0` stay apart
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return bits;
+    }
+    if (IS_OBJ(value))
+        return (uint64_t)(uintptr_t)AS_OBJ(value);
+    if (IS_BOOL(value))
+        return AS_BOOL(value) ? 1 : 2;
+    return 0;
+}
+
+static bool sameTree(Node *a, Node *b)
+{
+    if (a->type != b->type || a->op != b->op)
+        return false;
+    switch (a->type)
+    {
+    case NODE_LITERAL:
+        return IS_NUMBER(a->value) == IS_NUMBER(b->value) && literalBits(a->value) == literalBits(b->value);
+    case NODE_GET_LOCAL:
+    case NODE_GET_GLOBAL:
+        return a->slot == b->slot;
+    case NODE_UNARY:
+        return sameTree(a->left, b->left);
+    case NODE_BINARY:
+        return sameTree(a->left, b->left) && sameTree(a->right, b->right);
+    default:
+        return false;
+    }
+}
+
+static uint32_t mixHash(uint32_t hash, uint64_t value)
+{
+    hash ^= (uint32_t)value ^ (uint32_t)(value >> 32);
+    return hash * 16777619u;
+}
+
+// Hashes the subtree and lists its operators in evaluation order
+static uint32_t collectCandidates(Candidates *candidates, Node *node, int *size)
+{
+    uint32_t hash = mixHash(2166136261u, node->type * 256 + node->op);
+    int leftSize = 0;
+    int rightSize = 0;
+    switch (node->type)
+    {
+    case NODE_LITERAL:
+        hash = mixHash(hash, literalBits(node->value));
+        break;
+    case NODE_GET_LOCAL:
+    case NODE_GET_GLOBAL:
+        hash = mixHash(hash, node->slot);
+        break;
+    case NODE_BINARY:
+        hash = mixHash(hash, collectCandidates(candidates, node->left, &leftSize));
+        hash = mixHash(hash, collectCandidates(candidates, node->right, &rightSize));
+        break;
+    default:
+        hash = mixHash(hash, collectCandidates(candidates, node->left, &leftSize));
+        break;
+    }
+    *size = 1 + leftSize + rightSize;
+
+    if (node->type == NODE_UNARY || node->type == NODE_BINARY)
+    {
+        if (candidates->capacity < candidates->count + 1)
+        {
+            candidates->capacity = candidates->capacity < 8 ? 8 : candidates->capacity * 2;
+            candidates->items = realloc(candidates->items, sizeof(Candidate) * candidates->capacity);
+            if (candidates->items == NULL)
+                exit(1); // not enough memory
+        }
+        Candidate *candidate = &candidates->items[candidates->count];
+        candidate->node = node;
+        candidate->hash = hash;
+        candidate->size = *size;
+        candidate->order = candidates->count++;
+    }
+    return hash;
+}
+
+// Largest subtrees first, then equal hashes together, each in evaluation order
+static int compareCandidates(const void *a, const void *b)
+{
+    const Candidate *x = a;
+    const Candidate *y = b;
+    if (x->size != y->size)
+        return y->size - x->size;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->order - y->order;
+}
+
+static void skipOperands(Node *node)
+{
+    if (node->left != NULL)
+    {
+        node->left->skipped = true;
+        skipOperands(node->left);
+    }
+    if (node->right != NULL)
+    {
+        node->right->skipped = true;
+        skipOperands(node->right);
+    }
+}
+
+/*
+Computes repeated subexpressions of one statement once. The first occurrence saves its value to a
+hidden local pushed before the statement, the others load it. Nothing is evaluated earlier than
+before, so errors are raised where they were.
+Only statements without assignments below their root qualify: everything a subexpression reads
+then holds the same value during the whole statement.
+*/
+static void eliminateInStatement(Candidates *candidates, Node *statement, int depth)
+{
+    Node *value = statement->left;
+    if (value->type == NODE_SET_LOCAL || value->type == NODE_SET_GLOBAL)
+        value = value->left;
+    if (hasStores(value))
+        return;
+
+    int size;
+    candidates->count = 0;
+    collectCandidates(candidates, value, &size);
+    if (candidates->count < 2)
+        return;
+    qsort(candidates->items, candidates->count, sizeof(Candidate), compareCandidates);
+
+    for (int i = 0; i < candidates->count; i++)
+    {
+        Candidate *leader = &candidates->items[i];
+        if (leader->node == NULL || leader->node->skipped)
+            continue;
+
+        // Occurrences still emitted, found among the same size and hash
+        int occurrences = 1;
+        for (int j = i + 1; j < candidates->count && candidates->items[j].size == leader->size &&
+                            candidates->items[j].hash == leader->hash;
+             j++)
+        {
+            Node *node = candidates->items[j].node;
+            if (node != NULL && !node->skipped && sameTree(leader->node, node))
+                occurrences++;
+        }
+
+        // Saving costs a store, a load per reuse and pushing and popping the hidden local
+        int saved = (occurrences - 1) * leader->size;
+        int cost = 1 + (occurrences - 1) + 2;
+        int slot = depth + statement->temps;
+        if (occurrences < 2 || saved <= cost || slot >= UINT8_MAX)
+            continue;
+
+        statement->temps++;
+        leader->node->temp = slot;
+        for (int j = i + 1; j < candidates->count && candidates->items[j].size == leader->size &&
+                            candidates->items[j].hash == leader->hash;
+             j++)
+        {
+            Node *node = candidates->items[j].node;
+            if (node != NULL && !node->skipped && sameTree(leader->node, node))
+            {
+                node->temp = slot;
+                node->reuse = true;
+                skipOperands(node);
+                candidates->items[j].node = NULL;
+            }
+        }
+    }
+}
+
+static void eliminateCommonSubexpressions(Program *program)
+{
+    Candidates candidates = {NULL, 0, 0};
+    int depth = 0; // Locals in scope
+    for (int i = 0; i < program->count; i++)
+    {
+        Node *statement = program->statements[i];
+        switch (statement->type)
+        {
+        case NODE_PRINT:
+        case NODE_EXPRESSION:
+        case NODE_DEFINE_GLOBAL:
+            eliminateInStatement(&candidates, statement, depth);
+            break;
+        case NODE_DECLARE_LOCAL:
+            depth++; // its value becomes the next slot, so no hidden local may sit below it
+            break;
+        case NODE_DROP_LOCAL:
+            depth--;
+            break;
+        default:
+            break;
+        }
+    }
+    free(candidates.items);
+}
+
+/*
+Optimises the code of `chunk`, which must not contain its `OP_RETURN` yet.
+@return `int` - offset of the last instruction, -1 if there is none
+*/
+int optimizeChunk(Parser *parser, Chunk *chunk)
+{
+    Program program;
+    initProgram(&program);
+    liftChunk(&program, chunk);
+
+    propagateConstants(parser, &program);
+    eliminateDeadCode(parser->vm, &program);
+    eliminateCommonSubexpressions(&program);
+
+    int lastInstruction = emitProgram(parser, &program, chunk);
+    freeProgram(&program);
+    return lastInstruction;
+}
@@ -0,0 +1,12 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+#include "parser.h"
+#include "vm.h"
+
+bool foldUnary(uint8_t op, Value operand, Value *result);
+bool foldBinary(VM *vm, uint8_t op, Value a, Value b, Value *result);
+int optimizeChunk(Parser *parser, Chunk *chunk);
+
+#endif
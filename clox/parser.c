@@ -1,41 +1,41 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "parser.h"
 #include "scanner.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "peephole.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-Parser parser;
-extern Compiler *compiler;
-Chunk *compilingChunk;
-
-static void expression(VM *vm);
-static void statement(VM *vm);
-void declaration(VM *vm);
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+void declaration(Parser *parser);
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(VM *vm, Precedence precedence);
-
-Chunk *currentChunk()
-{
-    return compilingChunk;
-}
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-void initParser()
+void initParser(Parser *parser, VM *vm, Compiler *compiler, Chunk *chunk, TokenBuffer *tokens)
 {
-    parser.hadError = false;
-    parser.panicMode = false;
+    parser->vm = vm;
+    parser->compiler = compiler;
+    parser->chunk = chunk;
+    parser->tokens = tokens;
+    parser->nextToken = 0;
+    parser->hadError = false;
+    parser->panicMode = false;
 }
 
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
-    if (parser.panicMode)
+    if (parser->panicMode)
         return; // Supress any errors if one is already found
-    parser.panicMode = true;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -52,240 +52,525 @@ static void errorAt(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
 
 // Declare error at previous token
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
 
-void advance()
+void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        if (parser->tokens != NULL)
+        {
+            parser->current = tokenAt(parser->tokens, parser->nextToken);
+            if (parser->current.type != TOKEN_EOF) // the parser may look past the end, which stays at EOF
+                parser->nextToken++;
+        }
+        else
+        {
+            parser->current = scanToken(&parser->scanner);
+        }
+        if (parser->current.type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        advance();
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-bool match(TokenType type)
+bool match(Parser *parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
+{
+    writeChunk(parser->chunk, byte, parser->previous.line);
+}
+
+// Emits the opcode of a new instruction, or fuses it into the previous one (see peephole.c)
+static void emitOp(Parser *parser, uint8_t opcode)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    Compiler *current = parser->compiler;
+    Chunk *chunk = parser->chunk;
+    if (fuseInstruction(chunk, current->lastInstruction, opcode, parser->previous.line))
+        return;
+    current->lastInstruction = chunk->count;
+    emitByte(parser, opcode);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitOps(Parser *parser, uint8_t opcode1, uint8_t opcode2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitOp(parser, opcode1);
+    emitOp(parser, opcode2);
 }
 
-void emitReturn()
+void emitReturn(Parser *parser)
 {
-    emitByte(OP_RETURN);
+    emitOp(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+// Emits a 24-bit operand, low byte first
+static void emitLong(Parser *parser, uint32_t operand)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    emitByte(parser, operand & 0xff);
+    emitByte(parser, (operand >> 8) & 0xff);
+    emitByte(parser, (operand >> 16) & 0xff);
+}
+
+// Emits `op` with a one-byte operand, or its wide form `longOp` if `operand` doesn't fit
+static void emitIndexed(Parser *parser, uint8_t op, uint8_t longOp, int operand)
+{
+    if (operand <= UINT8_MAX)
     {
-        error("Too many constants in one chunk.");
-        return 0;
+        emitOp(parser, op);
+        emitByte(parser, (uint8_t)operand);
+    }
+    else
+    {
+        emitOp(parser, longOp);
+        emitLong(parser, operand);
     }
-
-    return (uint8_t)constant;
 }
 
-static void emitConstant(Value value)
+// Numbers are compared by their bits, so `0` and `-0` keep separate slots.
+// Strings are interned, so comparing pointers is enough for them.
+static uint64_t constantBits(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return bits;
+    }
+    if (IS_OBJ(value))
+        return (uint64_t)(uintptr_t)AS_OBJ(value);
+    return 0; // no other value types live in the pool
 }
 
-static void emitConstantLong(Value value)
+// Bits alone can't tell the types apart: a number may share the bits of a string's pointer
+static bool sameConstant(Value a, Value b)
 {
-    emitBytes(OP_CONSTANT_LONG, makeConstant(value));
+    if (IS_NUMBER(a) || IS_NUMBER(b))
+        return IS_NUMBER(a) && IS_NUMBER(b) && constantBits(a) == constantBits(b);
+    return valuesEqual(a, b); // the same object, or the same nil or boolean
 }
 
-static void binary(VM *vm, bool canAssign)
+static uint32_t hashConstant(uint64_t bits)
 {
-    TokenType operatorType = parser.previous.type;
-    ParseRule *rule = getRule(operatorType);
-    parsePrecedence(vm, (Precedence)(rule->precedence + 1));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
 
-    switch (operatorType)
-    {
-    case TOKEN_BANG_EQUAL:
+// Finds the place of `value` in the de-duplication set: either its pool index or an empty (-1) slot
+static int *findConstant(Parser *parser, int *indices, int capacity, Value value)
+{
+    Value *values = parser->chunk->constants.values;
+    uint32_t index = hashConstant(constantBits(value)) & (capacity - 1);
+    for (;;)
     {
-        emitBytes(OP_EQUAL, OP_NOT);
-        break;
+        int *slot = &indices[index];
+        if (*slot == -1 || sameConstant(values[*slot], value))
+            return slot;
+        index = (index + 1) & (capacity - 1);
     }
-    case TOKEN_EQUAL_EQUAL:
+}
+
+static void growConstantIndices(Parser *parser)
+{
+    Compiler *current = parser->compiler;
+    int capacity = current->constantCapacity < 64 ? 64 : current->constantCapacity * 2;
+    int *indices = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++)
+        indices[i] = -1;
+
+    Value *values = parser->chunk->constants.values;
+    for (int i = 0; i < current->constantCapacity; i++)
     {
-        emitByte(OP_EQUAL);
-        break;
+        int constant = current->constantIndices[i];
+        if (constant != -1)
+            *findConstant(parser, indices, capacity, values[constant]) = constant;
     }
-    case TOKEN_GREATER:
+
+    FREE_ARRAY(int, current->constantIndices, current->constantCapacity);
+    current->constantIndices = indices;
+    current->constantCapacity = capacity;
+}
+
+// Adds `value` to the constant pool, reusing the slot of an identical constant
+int makeConstant(Parser *parser, Value value)
+{
+    Compiler *current = parser->compiler;
+    Chunk *chunk = parser->chunk;
+    push(parser->vm, value); // `value` isn't reachable by the collector until it's in the pool
+    if ((chunk->constants.count + 1) * 4 > current->constantCapacity * 3)
+        growConstantIndices(parser);
+
+    int *slot = findConstant(parser, current->constantIndices, current->constantCapacity, value);
+    if (*slot != -1)
     {
-        emitByte(OP_GREATER);
-        break;
+        pop(parser->vm);
+        return *slot;
     }
-    case TOKEN_GREATER_EQUAL:
+
+    int constant = addConstant(chunk, value);
+    pop(parser->vm);
+    if (constant > UINT24_MAX)
     {
-        emitBytes(OP_LESS, OP_NOT);
-        break;
+        error(parser, "Too many constants in one chunk.");
+        return 0;
     }
-    case TOKEN_LESS:
+
+    *slot = constant;
+    return constant;
+}
+
+static void emitConstant(Parser *parser, Value value)
+{
+    emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
+}
+
+// Emits `value` the way a literal of it would be
+static void emitValue(Parser *parser, Value value)
+{
+    if (IS_NIL(value))
+        emitOp(parser, OP_NIL);
+    else if (IS_BOOL(value))
+        emitOp(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(parser, value);
+}
+
+// Reads the value the instruction at `offset` loads, if it is a literal
+static bool constantAt(Parser *parser, int offset, Value *value)
+{
+    if (offset < 0)
+        return false;
+
+    Chunk *chunk = parser->chunk;
+    uint8_t *code = &chunk->code[offset];
+    switch (code[0])
     {
-        emitByte(OP_LESS);
-        break;
+    case OP_CONSTANT:
+        *value = chunk->constants.values[code[1]];
+        return true;
+    case OP_CONSTANT_LONG:
+        *value = chunk->constants.values[code[1] | (code[2] << 8) | (code[3] << 16)];
+        return true;
+    case OP_NIL:
+        *value = NIL_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
     }
-    case TOKEN_LESS_EQUAL:
+}
+
+// Replaces the code from `offset` on, the literal operands of an operator, with its result
+static void emitFolded(Parser *parser, int offset, Value value)
+{
+    truncateChunk(parser->chunk, offset);
+    parser->compiler->lastInstruction = -1; // nothing left to fuse with
+    emitValue(parser, value);
+}
+
+// Opcode of a binary operator. `!=`, `>=` and `<=` are named by the superinstructions of their pairs
+static uint8_t binaryOp(TokenType operatorType)
+{
+    switch (operatorType)
     {
-        emitBytes(OP_GREATER, OP_NOT);
-        break;
-    }
+    case TOKEN_BANG_EQUAL:
+        return OP_NOT_EQUAL;
+    case TOKEN_EQUAL_EQUAL:
+        return OP_EQUAL;
+    case TOKEN_GREATER:
+        return OP_GREATER;
+    case TOKEN_GREATER_EQUAL:
+        return OP_GREATER_EQUAL;
+    case TOKEN_LESS:
+        return OP_LESS;
+    case TOKEN_LESS_EQUAL:
+        return OP_LESS_EQUAL;
     case TOKEN_DIAMOND:
-    {
-        emitByte(OP_DIAMOND);
-        return;
-    }
+        return OP_DIAMOND;
     case TOKEN_PLUS:
-    {
-        emitByte(OP_ADD);
-        break;
-    }
+        return OP_ADD;
     case TOKEN_MINUS:
-    {
-        emitByte(OP_SUBTRACT);
-        break;
-    }
+        return OP_SUBTRACT;
     case TOKEN_STAR:
+        return OP_MULTIPLY;
+    case TOKEN_SLASH:
+        return OP_DIVIDE;
+    default:
+        return OP_RETURN; // Unreachable.
+    }
+}
+
+static void binary(Parser *parser, bool canAssign)
+{
+    Compiler *current = parser->compiler;
+    TokenType operatorType = parser->previous.type;
+    ParseRule *rule = getRule(operatorType);
+    uint8_t op = binaryOp(operatorType);
+
+    // A literal operand is a single instruction, so both operands being literals means
+    // the code from the left one on is exactly the two loads
+    int leftOffset = current->lastInstruction;
+    Value left, right, result;
+    bool leftConstant = constantAt(parser, leftOffset, &left);
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (leftConstant && current->lastInstruction != leftOffset &&
+        constantAt(parser, current->lastInstruction, &right) &&
+        foldBinary(parser->vm, op, left, right, &result))
     {
-        emitByte(OP_MULTIPLY);
-        break;
+        emitFolded(parser, leftOffset, result);
+        return;
     }
-    case TOKEN_SLASH:
+
+    switch (op)
     {
-        emitByte(OP_DIVIDE);
+    case OP_NOT_EQUAL:
+        emitOps(parser, OP_EQUAL, OP_NOT);
+        break;
+    case OP_GREATER_EQUAL:
+        emitOps(parser, OP_LESS, OP_NOT);
+        break;
+    case OP_LESS_EQUAL:
+        emitOps(parser, OP_GREATER, OP_NOT);
         break;
-    }
     default:
-        return; // Unreachable.
+        emitOp(parser, op);
+        break;
     }
 }
 
-static void literal(VM *vm, bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitOp(parser, OP_FALSE);
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitOp(parser, OP_NIL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitOp(parser, OP_TRUE);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-static void expression(VM *vm)
+static void expression(Parser *parser)
 {
-    parsePrecedence(vm, PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static uint8_t identifierConstant(VM *vm, Token *name)
+// Resolves a global variable name to its slot in `vm->globalValues`
+static int identifierSlot(Parser *parser, Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(vm, name->start, name->length)));
+    int slot = globalSlot(parser->vm, copyString(parser->vm, name->start, name->length));
+    if (slot > UINT24_MAX)
+    {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
-static uint8_t parseVariable(VM *vm, const char *errorMessage)
+static bool identifiersEqual(Token *a, Token *b)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-    return identifierConstant(vm, &parser.previous);
+    if (a->length != b->length)
+        return false;
+    return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void defineVariable(uint8_t global)
+// Finds the stack slot of a local variable
+// @return slot index, or -1 if `name` is not a local (so it must be global)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    for (int i = compiler->localCount - 1; i >= 0; i--)
+    {
+        Local *local = &compiler->locals[i];
+        if (identifiersEqual(name, &local->name))
+        {
+            if (local->depth == -1)
+                error(parser, "Can't read local variable in its own initializer.");
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void addLocal(Parser *parser, Token name)
+{
+    Compiler *current = parser->compiler;
+    if (current->localCount == UINT8_COUNT)
+    {
+        error(parser, "Too many local variables in scope.");
+        return;
+    }
+
+    Local *local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1; // declared, but not initialized yet
+}
+
+// Records a local variable in the current scope. Globals are late bound, so they are skipped
+static void declareVariable(Parser *parser)
+{
+    Compiler *current = parser->compiler;
+    if (current->scopeDepth == 0)
+        return;
+
+    Token *name = &parser->previous;
+    for (int i = current->localCount - 1; i >= 0; i--)
+    {
+        Local *local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth)
+            break;
+
+        if (identifiersEqual(name, &local->name))
+            error(parser, "Already a variable with this name in this scope.");
+    }
+
+    addLocal(parser, *name);
 }
 
-static void varDeclaration(VM *vm)
+static int parseVariable(Parser *parser, const char *errorMessage)
 {
-    uint8_t global = parseVariable(vm, "Expect variable name.");
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    if (match(TOKEN_EQUAL))
-        expression(vm);
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
+        return 0; // locals aren't looked up by name at runtime
+
+    return identifierSlot(parser, &parser->previous);
+}
+
+static void markInitialized(Parser *parser)
+{
+    Compiler *current = parser->compiler;
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+static void defineVariable(Parser *parser, int global)
+{
+    if (parser->compiler->scopeDepth > 0)
+    {
+        // The initializer's value already sits in the local's stack slot
+        markInitialized(parser);
+        return;
+    }
+
+    emitIndexed(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+}
+
+static void varDeclaration(Parser *parser)
+{
+    int global = parseVariable(parser, "Expect variable name.");
+
+    if (match(parser, TOKEN_EQUAL))
+        expression(parser);
     else
-        emitByte(OP_NIL);
+        emitOp(parser, OP_NIL);
+
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(parser, global);
+}
+
+static void beginScope(Parser *parser)
+{
+    parser->compiler->scopeDepth++;
+}
+
+static void endScope(Parser *parser)
+{
+    Compiler *current = parser->compiler;
+    current->scopeDepth--;
+
+    while (current->localCount > 0 &&
+           current->locals[current->localCount - 1].depth > current->scopeDepth)
+    {
+        emitOp(parser, OP_POP);
+        current->localCount--;
+    }
+}
+
+static void block(Parser *parser)
+{
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+        declaration(parser);
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-    defineVariable(global);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void expressionStatement(VM *vm)
+static void expressionStatement(Parser *parser)
 {
-    expression(vm);
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitOp(parser, OP_POP);
 }
 
-static void printStatement(VM *vm)
+static void printStatement(Parser *parser)
 {
-    expression(vm);
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitOp(parser, OP_PRINT);
 }
 
 // Skips entire line or expression until semicolon is met
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -300,84 +585,106 @@ static void synchronize()
         default:; // Do nothing.
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void statement(VM *vm)
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT))
-        printStatement(vm);
+    if (match(parser, TOKEN_PRINT))
+        printStatement(parser);
+    else if (match(parser, TOKEN_LEFT_BRACE))
+    {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+    }
     else
-        expressionStatement(vm);
+        expressionStatement(parser);
 }
 
-void declaration(VM *vm)
+void declaration(Parser *parser)
 {
-    if (match(TOKEN_VAR))
-        varDeclaration(vm);
+    if (match(parser, TOKEN_VAR))
+        varDeclaration(parser);
     else
-        statement(vm);
+        statement(parser);
 
-    if (parser.panicMode)
-        synchronize();
+    if (parser->panicMode)
+        synchronize(parser);
 }
 
-static void grouping(VM *vm, bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-    expression(vm);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(VM *vm, bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string(VM *vm, bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
-    const char *start = parser.previous.start + 1; // to trim leading quote
-    size_t end = (parser.previous.length - 1) - 1; // to trim trailing quote
-    emitConstant(OBJ_VAL(copyString(vm, start, end)));
+    const char *start = parser->previous.start + 1; // to trim leading quote
+    size_t end = (parser->previous.length - 1) - 1; // to trim trailing quote
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm, start, end)));
 }
 
-static void namedVariable(VM *vm, Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
-    uint8_t arg = identifierConstant(vm, &name);
-    if (canAssign && match(TOKEN_EQUAL))
+    uint8_t getOp, setOp, getLongOp, setLongOp;
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    if (arg != -1)
+    {
+        // Locals never exceed `UINT8_COUNT`, so they have no wide forms
+        getOp = getLongOp = OP_GET_LOCAL;
+        setOp = setLongOp = OP_SET_LOCAL;
+    }
+    else
+    {
+        arg = identifierSlot(parser, &name);
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
+    }
+
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression(vm);
-        emitBytes(OP_SET_GLOBAL, arg);
+        expression(parser);
+        emitIndexed(parser, setOp, setLongOp, arg);
     }
     else
-        emitBytes(OP_GET_GLOBAL, arg);
+        emitIndexed(parser, getOp, getLongOp, arg);
 }
 
-static void variable(VM *vm, bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-    namedVariable(vm, parser.previous, canAssign);
+    namedVariable(parser, parser->previous, canAssign);
 }
 
-static void unary(VM *vm, bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand.
-    parsePrecedence(vm, PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
-    // Emit the operator instruction.
-    switch (operatorType)
+    // Fold it if it's a literal; `-` of anything but a number stays a runtime error
+    uint8_t op = operatorType == TOKEN_BANG ? OP_NOT : OP_NEGATE;
+    Value operand, result;
+    int operandOffset = parser->compiler->lastInstruction;
+    if (constantAt(parser, operandOffset, &operand) && foldUnary(op, operand, &result))
     {
-    case TOKEN_BANG:
-        emitByte(OP_NOT);
-        break;
-    case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
-        break;
-    default:
-        return; // Unreachable.
+        emitFolded(parser, operandOffset, result);
+        return;
     }
+
+    // Emit the operator instruction.
+    emitOp(parser, op);
 }
 
 ParseRule rules[] = {
@@ -431,28 +738,28 @@ static ParseRule *getRule(TokenType type)
     return &rules[type];
 }
 
-static void parsePrecedence(VM *vm, Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     // The only time we allow an assignment is when parsing an assignment expression or top-level
     // expression like in an expression statement
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(vm, canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence)
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(vm, canAssign);
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL))
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL))
+        error(parser, "Invalid assignment target.");
 }
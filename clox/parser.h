@@ -4,6 +4,7 @@
 #include "object.h"
 #include "scanner.h"
 #include "chunk.h"
+#include "compiler.h"
 
 typedef enum
 {
@@ -21,28 +22,35 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(VM *vm, bool canAssign);
-
-typedef struct
-{
-    ParseFn prefix;
-    ParseFn infix;
-    Precedence precedence;
-} ParseRule;
-
+// Everything one compilation works on, so separate compilations can run on separate threads
 typedef struct
 {
+    VM *vm;
+    Scanner scanner;     // Unused when scanning from `tokens`
+    Compiler *compiler;
+    Chunk *chunk;        // Chunk being compiled
     Token current;
     Token previous;
+    TokenBuffer *tokens; // Scanned up front, or NULL to scan as parsing goes
+    int nextToken;       // Index in `tokens` of the token after `current`
     bool hadError;
     bool panicMode;
 } Parser;
 
-void initParser();
-Chunk *currentChunk();
-void advance();
-bool match(TokenType type);
-void emitReturn();
-void declaration(VM *vm);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
+
+typedef struct
+{
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence precedence;
+} ParseRule;
+
+void initParser(Parser *parser, VM *vm, Compiler *compiler, Chunk *chunk, TokenBuffer *tokens);
+void advance(Parser *parser);
+bool match(Parser *parser, TokenType type);
+void emitReturn(Parser *parser);
+int makeConstant(Parser *parser, Value value);
+void declaration(Parser *parser);
 
 #endif
@@ -0,0 +1,80 @@
+#include "peephole.h"
+
+#ifndef NO_PEEPHOLE
+/*
+Superinstruction for `first` followed by `second`, or `first` if the pair isn't fused.
+The second instruction never has operands; the fused one keeps the operands of the first.
+Pairs chosen from -DDEBUG_PROFILE_PAIRS runs over the bench.sh workloads.
+*/
+static uint8_t fuse(uint8_t first, uint8_t second)
+{
+    switch (second)
+    {
+    case OP_NOT:
+        switch (first)
+        {
+        case OP_EQUAL:
+            return OP_NOT_EQUAL;
+        case OP_LESS:
+            return OP_GREATER_EQUAL;
+        case OP_GREATER:
+            return OP_LESS_EQUAL;
+        }
+        break;
+    case OP_ADD:
+        switch (first)
+        {
+        case OP_CONSTANT:
+            return OP_ADD_CONST;
+        case OP_GET_GLOBAL:
+            return OP_GET_GLOBAL_ADD;
+        case OP_GET_LOCAL:
+            return OP_GET_LOCAL_ADD;
+        }
+        break;
+    case OP_POP:
+        switch (first)
+        {
+        case OP_SET_GLOBAL:
+            return OP_SET_GLOBAL_POP;
+        case OP_SET_LOCAL:
+            return OP_SET_LOCAL_POP;
+        }
+        break;
+    }
+    return first;
+}
+#endif
+
+/*
+Peephole pass run as the compiler emits each instruction: if `opcode` completes a common pair with
+the instruction at `previous`, that instruction is turned into the superinstruction and `opcode` is
+never written. The VM then dispatches once where it dispatched twice.
+Fusing as code is emitted, rather than in a pass over the finished chunk, costs nothing extra:
+Lox has no loops yet, so every instruction runs once and a second walk over the code took longer
+than the dispatches it saved.
+Only pairs within one source line are fused, so runtime errors keep reporting the right line.
+@return `bool` - was `opcode` fused into the previous instruction
+*/
+bool fuseInstruction(Chunk *chunk, int previous, uint8_t opcode, int line)
+{
+#ifdef NO_PEEPHOLE
+    (void)chunk;
+    (void)previous;
+    (void)opcode;
+    (void)line;
+    return false;
+#else
+    if (previous < 0 || chunk->lineCount == 0)
+        return false;
+    LineStart *run = &chunk->lines[chunk->lineCount - 1];
+    if (run->line != line || run->offset > previous)
+        return false;
+
+    uint8_t fused = fuse(chunk->code[previous], opcode);
+    if (fused == chunk->code[previous])
+        return false;
+    chunk->code[previous] = fused;
+    return true;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,8 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+bool fuseInstruction(Chunk *chunk, int previous, uint8_t opcode, int line);
+
+#endif
\ No newline at end of file
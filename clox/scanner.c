@@ -3,297 +3,458 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
-Scanner scanner;
+// SSE2 is part of x86-64, so this is the usual path there; -DNO_SIMD_SCANNER forces the byte loops
+#if defined(__SSE2__) && !defined(NO_SIMD_SCANNER)
+#include <emmintrin.h>
+#define SIMD_SCANNER
+#endif
+
 
-void initScanner(const char *source)
+void initScanner(Scanner *scanner, const char *source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+}
+
+// Character classes, ordered so that `>= CHAR_DIGIT` means "can continue an identifier"
+typedef enum
+{
+    CHAR_OTHER,
+    CHAR_SPACE,   // ' ', '\t', '\r'
+    CHAR_NEWLINE, // '\n'
+    CHAR_DIGIT,   // '0'-'9'
+    CHAR_ALPHA,   // 'A'-'Z', 'a'-'z', '_'
+} CharClass;
+
+#define DIGITS(c) [c] = CHAR_DIGIT, [c + 1] = CHAR_DIGIT, [c + 2] = CHAR_DIGIT, [c + 3] = CHAR_DIGIT, [c + 4] = CHAR_DIGIT
+#define LETTERS(c) [c] = CHAR_ALPHA, [c + 1] = CHAR_ALPHA, [c + 2] = CHAR_ALPHA, [c + 3] = CHAR_ALPHA, [c + 4] = CHAR_ALPHA
+
+// One lookup per character instead of a chain of range comparisons; bytes >= 0x80 are `CHAR_OTHER`
+static const uint8_t charClass[256] = {
+    [' '] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['\n'] = CHAR_NEWLINE,
+    DIGITS('0'),
+    DIGITS('5'),
+    LETTERS('A'),
+    LETTERS('F'),
+    LETTERS('K'),
+    LETTERS('P'),
+    LETTERS('U'),
+    ['Z'] = CHAR_ALPHA,
+    LETTERS('a'),
+    LETTERS('f'),
+    LETTERS('k'),
+    LETTERS('p'),
+    LETTERS('u'),
+    ['z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+};
+
+#undef DIGITS
+#undef LETTERS
+
+static inline CharClass classOf(char c)
+{
+    return (CharClass)charClass[(uint8_t)c];
 }
 
 static bool isDigit(char c)
 {
-    return c >= '0' && c <= '9';
+    return classOf(c) == CHAR_DIGIT;
 }
 
 static bool isAlpha(char c)
 {
-    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+    return classOf(c) == CHAR_ALPHA;
 }
 
 static bool isAlphaNumeric(char c)
 {
-    return isDigit(c) || isAlpha(c);
+    return classOf(c) >= CHAR_DIGIT;
+}
+
+static bool isSpace(char c)
+{
+    CharClass class = classOf(c);
+    return class == CHAR_SPACE || class == CHAR_NEWLINE;
 }
 
-bool isAtEnd()
+static bool isAtEnd(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-    scanner.current++;          // consume
-    return scanner.current[-1]; // return last
+    scanner->current++;          // consume
+    return scanner->current[-1]; // return last
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.current; // doesn't consume!!!
+    return *scanner->current; // doesn't consume!!!
 }
 
-static char peekNext()
+static char peekNext(Scanner *scanner)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return '\0';
-    return scanner.current[1]; // doesn't consume!!!
+    return scanner->current[1]; // doesn't consume!!!
 }
 
-Token makeToken(TokenType tokenType)
+static Token makeToken(Scanner *scanner, TokenType tokenType)
 {
     Token token;
     token.type = tokenType;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-Token errorToken(char *const message)
+static Token errorToken(Scanner *scanner, char *const message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-    if (isAtEnd())
+    if (isAtEnd(scanner))
         return false;
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
-    scanner.current++; // consume
+    scanner->current++; // consume
     return true;
 }
 
-static Token string()
+#ifdef SIMD_SCANNER
+typedef enum
+{
+    SKIP_SPACES,  // up to anything but ' ', '\t', '\r', '\n'
+    SKIP_COMMENT, // up to the '\n' ending the comment
+    SKIP_STRING,  // up to the closing '`'
+} SkipKind;
+
+// Skips 16 bytes per step, counting the newlines passed, and returns the first byte it stops at.
+// The terminating '\0' always stops it. Loads are 16-byte aligned so they never cross into the
+// page after that '\0', but they may read past the end of its allocation, hence no ASan checks.
+__attribute__((no_sanitize_address)) static inline const char *skipBlocks(Scanner *scanner, const char *from, SkipKind kind)
 {
-    while (peek() != '`' && !isAtEnd())
+    const char *block = (const char *)((uintptr_t)from & ~(uintptr_t)15);
+    unsigned live = (0xffffu << (from - block)) & 0xffff; // bytes from `from` onwards, within the block
+    for (;; block += 16, live = 0xffff)
     {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+        __m128i bytes = _mm_load_si128((const __m128i *)block);
+        unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+        unsigned stops;
+        switch (kind)
+        {
+        case SKIP_SPACES:
+            stops = ~(newlines |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '))) |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))) |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+            break;
+        case SKIP_COMMENT:
+            stops = newlines | _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+            break;
+        case SKIP_STRING:
+            stops = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('`'))) |
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+            break;
+        }
+
+        stops &= live;
+        if (stops != 0)
+        {
+            if (kind != SKIP_COMMENT)
+                scanner->line += __builtin_popcount(newlines & live & ((stops & -stops) - 1));
+            return block + __builtin_ctz(stops);
+        }
+        if (kind != SKIP_COMMENT)
+            scanner->line += __builtin_popcount(newlines & live);
     }
+}
+
+static const char *skipSpaces(Scanner *scanner, const char *from)
+{
+    return skipBlocks(scanner, from, SKIP_SPACES);
+}
+
+static const char *skipComment(Scanner *scanner, const char *from)
+{
+    return skipBlocks(scanner, from, SKIP_COMMENT);
+}
+
+static const char *skipString(Scanner *scanner, const char *from)
+{
+    return skipBlocks(scanner, from, SKIP_STRING);
+}
+#else
+static const char *skipSpaces(Scanner *scanner, const char *from)
+{
+    for (; isSpace(*from); from++)
+        if (*from == '\n')
+            scanner->line++;
+    return from;
+}
+
+static const char *skipComment(Scanner *scanner, const char *from)
+{
+    (void)scanner; // the '\n' ending the comment is counted by `skipSpaces()`
+    while (*from != '\n' && *from != '\0')
+        from++;
+    return from;
+}
+
+static const char *skipString(Scanner *scanner, const char *from)
+{
+    for (; *from != '`' && *from != '\0'; from++)
+        if (*from == '\n')
+            scanner->line++;
+    return from;
+}
+#endif
+
+static Token string(Scanner *scanner)
+{
+    scanner->current = skipString(scanner, scanner->current);
 
-    if (isAtEnd())
-        return errorToken("Unterminated string.");
+    if (isAtEnd(scanner))
+        return errorToken(scanner, "Unterminated string.");
 
-    advance(); // The closing quote
-    return makeToken(TOKEN_STRING);
+    advance(scanner); // The closing quote
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number()
+static Token number(Scanner *scanner)
 {
-    while (isDigit(peek()))
-        advance();
+    while (isDigit(peek(scanner)))
+        advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && isDigit(peekNext()))
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
         // Consume the ".".
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek()))
-            advance();
+        while (isDigit(peek(scanner)))
+            advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-TokenType checkKeyword(
-    int start, int length, const char *rest, TokenType type)
+typedef struct
 {
-    bool sameLength = scanner.current - scanner.start == start + length;
-    if (sameLength && memcmp(scanner.start + start, rest, length) == 0)
-    {
-        return type;
-    }
+    const char *name;
+    int length;
+    TokenType type;
+} Keyword;
 
-    return TOKEN_IDENTIFIER;
-}
+// Perfect hash of the keywords: no two of them share a slot, so one comparison decides
+#define KEYWORD_HASH(start, length) (((uint8_t)(start)[0] + (uint8_t)(start)[(length) - 1] * 7 + ((length) << 1)) & 31)
+
+static const Keyword keywords[32] = {
+    [0] = {"return", 6, TOKEN_RETURN},
+    [1] = {"this", 4, TOKEN_THIS},
+    [3] = {"and", 3, TOKEN_AND},
+    [4] = {"while", 5, TOKEN_WHILE},
+    [6] = {"print", 5, TOKEN_PRINT},
+    [8] = {"nil", 3, TOKEN_NIL},
+    [10] = {"for", 3, TOKEN_FOR},
+    [14] = {"fun", 3, TOKEN_FUN},
+    [16] = {"else", 4, TOKEN_ELSE},
+    [17] = {"or", 2, TOKEN_OR},
+    [18] = {"class", 5, TOKEN_CLASS},
+    [19] = {"false", 5, TOKEN_FALSE},
+    [23] = {"if", 2, TOKEN_IF},
+    [25] = {"exit", 4, TOKEN_EXIT},
+    [26] = {"var", 3, TOKEN_VAR},
+    [27] = {"super", 5, TOKEN_SUPER},
+    [28] = {"xor", 3, TOKEN_XOR},
+    [31] = {"true", 4, TOKEN_TRUE},
+};
 
-static TokenType identifierType()
+static TokenType identifierType(Scanner *scanner)
 {
-#ifndef IS_THERE_SECOND_CHAR
-#define IS_THERE_SECOND_CHAR() = scanner.current - scanner.start > 1;
-    switch (scanner.start[0])
-    {
-    case 'a':
-        return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-        return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'l':
-                return checkKeyword(1, 2, "se", TOKEN_ELSE);
-            case 'x':
-                return checkKeyword(1, 2, "it", TOKEN_EXIT);
-            }
-        }
-        break;
-    case 'f':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'a':
-                return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-            case 'o':
-                return checkKeyword(2, 1, "r", TOKEN_FOR);
-            case 'u':
-                return checkKeyword(2, 1, "n", TOKEN_FUN);
-            }
-        }
-        break;
-    case 'i':
-        return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-        return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-        return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-        return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-        return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-        if (scanner.current - scanner.start > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'h':
-                return checkKeyword(2, 2, "is", TOKEN_THIS);
-            case 'r':
-                return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-            }
-        }
-        break;
-    case 'v':
-        return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'x':
-        return checkKeyword(1, 2, "or", TOKEN_XOR);
-    case 'w':
-        return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
+    int length = (int)(scanner->current - scanner->start);
+    if (length < 2 || length > 6) // no keyword is shorter or longer
+        return TOKEN_IDENTIFIER;
 
+    const Keyword *keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->name, length) == 0)
+        return keyword->type;
     return TOKEN_IDENTIFIER;
-#endif
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-    while (isAlpha(peek()) || isDigit(peek()))
-        advance();
-    return makeToken(identifierType());
+    while (isAlphaNumeric(peek(scanner)))
+        advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static void skipWhitespace()
+static void skipWhitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = peek();
-        switch (c)
+        switch (classOf(peek(scanner)))
         {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance();
+        case CHAR_SPACE:
+        case CHAR_NEWLINE:
+            // Most gaps are a single space, not worth setting up a block scan for
+            if (isSpace(peekNext(scanner)))
+                scanner->current = skipSpaces(scanner, scanner->current);
+            else if (advance(scanner) == '\n')
+                scanner->line++;
             break;
-        case '\n':
-            scanner.line++;
-            advance();
-            break;
-        case '/':
-            if (peekNext() == '/')
-            {
+        default:
+            if (peek(scanner) == '/' && peekNext(scanner) == '/')
                 // A comment goes until the end of the line.
-                while (peek() != '\n' && !isAtEnd())
-                    advance();
-            }
+                scanner->current = skipComment(scanner, scanner->current);
             else
-            {
                 return;
-            }
-            break;
-        default:
-            return;
         }
     }
 }
 
-Token scanToken()
+Token scanToken(Scanner *scanner)
 {
-    skipWhitespace();
-    scanner.start = scanner.current;
-    if (isAtEnd())
-        return makeToken(TOKEN_EOF);
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
+    if (isAtEnd(scanner))
+        return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
     if (isAlpha(c))
-        return identifier();
+        return identifier(scanner);
     if (isDigit(c))
-        return number();
+        return number(scanner);
 
     switch (c)
     {
     case '(':
-        return makeToken(TOKEN_LEFT_PAREN);
+        return makeToken(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return makeToken(TOKEN_RIGHT_PAREN);
+        return makeToken(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return makeToken(TOKEN_LEFT_BRACE);
+        return makeToken(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return makeToken(TOKEN_RIGHT_BRACE);
+        return makeToken(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return makeToken(TOKEN_SEMICOLON);
+        return makeToken(scanner, TOKEN_SEMICOLON);
     case ',':
-        return makeToken(TOKEN_COMMA);
+        return makeToken(scanner, TOKEN_COMMA);
     case '.':
-        return makeToken(TOKEN_DOT);
+        return makeToken(scanner, TOKEN_DOT);
     case '-':
-        return makeToken(TOKEN_MINUS);
+        return makeToken(scanner, TOKEN_MINUS);
     case '+':
-        return makeToken(TOKEN_PLUS);
+        return makeToken(scanner, TOKEN_PLUS);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(scanner, TOKEN_SLASH);
     case '*':
-        return makeToken(TOKEN_STAR);
+        return makeToken(scanner, TOKEN_STAR);
     case '!':
-        return makeToken(
-            match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return makeToken(scanner,
+                         match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return makeToken(
-            match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return makeToken(scanner,
+                         match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return makeToken(
-            match('=') ? TOKEN_LESS_EQUAL : match('>') ? TOKEN_DIAMOND
-                                                       : TOKEN_LESS);
+        return makeToken(scanner,
+                         match(scanner, '=')   ? TOKEN_LESS_EQUAL
+                         : match(scanner, '>') ? TOKEN_DIAMOND
+                                               : TOKEN_LESS);
     case '>':
-        return makeToken(
-            match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return makeToken(scanner,
+                         match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '`':
-        return string();
+        return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
+}
+
+void initTokenBuffer(TokenBuffer *tokens)
+{
+    tokens->source = NULL;
+    tokens->count = 0;
+    tokens->capacity = 0;
+    tokens->types = NULL;
+    tokens->starts = NULL;
+    tokens->lengths = NULL;
+    tokens->lines = NULL;
+    tokens->messages = NULL;
+    tokens->messageCount = 0;
+    tokens->messageCapacity = 0;
+}
+
+void freeTokenBuffer(TokenBuffer *tokens)
+{
+    FREE_ARRAY(uint8_t, tokens->types, tokens->capacity);
+    FREE_ARRAY(uint32_t, tokens->starts, tokens->capacity);
+    FREE_ARRAY(uint32_t, tokens->lengths, tokens->capacity);
+    FREE_ARRAY(int, tokens->lines, tokens->capacity);
+    FREE_ARRAY(const char *, tokens->messages, tokens->messageCapacity);
+    initTokenBuffer(tokens);
+}
+
+static void writeToken(TokenBuffer *tokens, Token token)
+{
+    if (tokens->capacity < tokens->count + 1)
+    {
+        int oldCapacity = tokens->capacity;
+        tokens->capacity = GROW_CAPACITY(oldCapacity);
+        tokens->types = GROW_ARRAY(uint8_t, tokens->types, oldCapacity, tokens->capacity);
+        tokens->starts = GROW_ARRAY(uint32_t, tokens->starts, oldCapacity, tokens->capacity);
+        tokens->lengths = GROW_ARRAY(uint32_t, tokens->lengths, oldCapacity, tokens->capacity);
+        tokens->lines = GROW_ARRAY(int, tokens->lines, oldCapacity, tokens->capacity);
+    }
+
+    uint32_t start = (uint32_t)(token.start - tokens->source);
+    if (token.type == TOKEN_ERROR)
+    {
+        if (tokens->messageCapacity < tokens->messageCount + 1)
+        {
+            int oldCapacity = tokens->messageCapacity;
+            tokens->messageCapacity = GROW_CAPACITY(oldCapacity);
+            tokens->messages = GROW_ARRAY(const char *, tokens->messages, oldCapacity, tokens->messageCapacity);
+        }
+        start = (uint32_t)tokens->messageCount;
+        tokens->messages[tokens->messageCount++] = token.start;
+    }
+
+    tokens->types[tokens->count] = (uint8_t)token.type;
+    tokens->starts[tokens->count] = start;
+    tokens->lengths[tokens->count] = (uint32_t)token.length;
+    tokens->lines[tokens->count] = token.line;
+    tokens->count++;
+}
+
+// Scans all of `source` into `tokens`, which then end with `TOKEN_EOF`. Sources must be under 4GB
+void scanTokens(TokenBuffer *tokens, const char *source)
+{
+    Scanner scanner;
+    initScanner(&scanner, source);
+    tokens->source = source;
+    for (;;)
+    {
+        Token token = scanToken(&scanner);
+        writeToken(tokens, token);
+        if (token.type == TOKEN_EOF)
+            return;
+    }
 }
@@ -0,0 +1,96 @@
+#!/bin/zsh
+# Builds the VM in several configurations and times each of them on generated workloads.
+# Usage: ./scripts/bench.sh [statements per workload] [git revision to compare against]
+set -e
+
+STATEMENTS=${1:-1000000}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if command -v clang > /dev/null; then
+    CC=clang
+else
+    CC=gcc
+fi
+
+# build <variant> [extra compiler flags]
+build() {
+    local name=$1
+    shift
+    $CC -O2 -DNDEBUG -pthread "$@" -o "$WORK/$name" *.c
+}
+
+# workload <name> <prologue> <statement repeated STATEMENTS times, '#' becomes its index> [epilogue]
+workload() {
+    awk -v n="$STATEMENTS" -v prologue="$2" -v body="$3" -v epilogue="$4" \
+        'BEGIN {
+            parts = split(body, part, "#")
+            print prologue
+            for (i = 0; i < n; i++) {
+                line = part[1]
+                for (p = 2; p <= parts; p++)
+                    line = line i part[p]
+                print line
+            }
+            print epilogue
+        }' \
+        > "$WORK/$1.lox"
+}
+
+build goto
+build switch -DNO_COMPUTED_GOTO
+build nanbox -DNAN_BOXING
+build incremental -DINCREMENTAL_GC
+build malloc -DNO_POOL_ALLOCATOR
+build fnv -DFNV_HASH
+build unfused -DNO_PEEPHOLE
+build bytescan -DNO_SIMD_SCANNER
+VARIANTS="goto goto-O goto-T switch nanbox incremental malloc fnv unfused bytescan"
+
+if [ -n "$2" ]; then
+    mkdir "$WORK/base"
+    git archive "$2" . | tar -x -C "$WORK/base"
+    (cd "$WORK/base" && $CC -O2 -DNDEBUG -pthread -o "$WORK/base-vm" *.c)
+    VARIANTS="base-vm $VARIANTS"
+fi
+
+workload logic "" "!(true == !false) == !(nil == !nil) == !!true;"
+workload arith "var a = 1; var b = 2;" "a = a * 0.5 + b - 1.25; b = (b + 3) / 2;"
+workload literals "var a = 0;" "a = a + #;"
+workload globals "var a = 1; var b = 2; var c = 3;" "a = b + c - a; b = a * c - b; c = (a <> b) + c;"
+workload locals "{ var a = 1; var b = 2; var c = 3;" "a = b + c - a; b = a * c - b; c = (a <> b) + c;" "}"
+workload strings "var t;" "t = \`piece#\` + \`-\` + \`tail\`;"
+workload identifiers "" "var identifier#; identifier# = \`key#\`;"
+workload compare "var a = 1; var b = 2; var c = false;" "c = a != b; c = a >= b; c = a <= b; a = a + #;"
+workload commented "var t;" "        t = \`a longer string literal, number #\`; // and a trailing comment about #"
+workload nested "" "((true == false) == (nil == !true)) == ((false == !false) == (!true == nil));"
+
+for file in "$WORK"/*.lox; do
+    for variant in $(echo "$VARIANTS"); do
+        echo "== $(basename "$file" .lox) [$variant]"
+        # `<build>-O` runs that build with the optimiser, `<build>-T` with a token buffer
+        if [ "${variant%-O}" != "$variant" ]; then
+            time "$WORK/${variant%-O}" -O "$file" > /dev/null 2>&1 || echo "$variant failed on this workload"
+        elif [ "${variant%-T}" != "$variant" ]; then
+            time "$WORK/${variant%-T}" -T "$file" > /dev/null 2>&1 || echo "$variant failed on this workload"
+        else
+            time "$WORK/$variant" "$file" > /dev/null 2>&1 || echo "$variant failed on this workload"
+        fi
+    done
+done
+
+# Table micro-benchmark: the same program linked against each tree's table and string code
+SOURCES=$(ls *.c | grep -v '^main.c$')
+$CC -O2 -DNDEBUG -pthread -I. -o "$WORK/table" bench/table.c $(echo "$SOURCES")
+TABLES="table"
+if [ -n "$2" ]; then
+    (cd "$WORK/base" && $CC -O2 -DNDEBUG -pthread -I. -o "$WORK/base-table" "$OLDPWD/bench/table.c" $(ls *.c | grep -v '^main.c$'))
+    TABLES="base-table table"
+fi
+
+for keys in 64 4096 1048576; do
+    for table in $(echo "$TABLES"); do
+        echo "== table, $keys keys [$table]"
+        "$WORK/$table" $keys
+    done
+done
@@ -2,7 +2,7 @@
 set -e
 
 if command -v clang > /dev/null; then
-    clang -o main *.c
+    clang -pthread -o main *.c
 else
-    gcc -o main *.c
+    gcc -pthread -o main *.c
 fi
\ No newline at end of file
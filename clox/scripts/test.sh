@@ -0,0 +1,146 @@
+#!/bin/zsh
+# Runs every script under test/ and checks what it prints against the expectations in its comments:
+#   // expect: <text>                   a line printed to stdout
+#   // expect runtime error: <message>  raised on this line, which ends the script with status 70
+#   // [line <n>] Error<...>            reported by the compiler, which exits with status 65
+# Each script also runs through the optimiser (-O), from a token buffer (-T), as a compiled image and
+# from an image cached beside it, none of which may change any of that.
+# Usage: ./scripts/test.sh
+set -e
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if command -v clang > /dev/null; then
+    CC=clang
+else
+    CC=gcc
+fi
+$CC -DNDEBUG -pthread -o "$WORK/clox" *.c
+
+FAILURES=0
+
+# expectations <script>: writes what it should print to $WORK/expected.out and .err, echoes its exit status
+expectations() {
+    awk -v out="$WORK/expected.out" -v err="$WORK/expected.err" '
+        BEGIN { status = 0; printf "" > out; printf "" > err }
+        { sub(/\r$/, "") }
+        match($0, /\/\/ expect: /) { print substr($0, RSTART + RLENGTH) > out }
+        match($0, /\/\/ expect runtime error: /) {
+            print substr($0, RSTART + RLENGTH) > err
+            print "[line " NR "] in script" > err
+            status = 70
+        }
+        match($0, /\/\/ \[line [0-9]+\] Error/) { print substr($0, RSTART + 3) > err; status = 65 }
+        END { print status }' "$1"
+}
+
+# check <description> <exit status> <command...>: runs the command and compares it with the expectations
+check() {
+    local description=$1
+    local expected=$2
+    shift 2
+    local actual=0
+    "$@" > "$WORK/actual.out" 2> "$WORK/actual.err" || actual=$?
+    if [ "$actual" != "$expected" ] ||
+        ! cmp -s "$WORK/expected.out" "$WORK/actual.out" ||
+        ! cmp -s "$WORK/expected.err" "$WORK/actual.err"; then
+        echo "FAIL $description: exit status $actual, expected $expected"
+        diff "$WORK/expected.out" "$WORK/actual.out" || true
+        diff "$WORK/expected.err" "$WORK/actual.err" || true
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# refuse <description> <image>: the image must be rejected without running any of it
+refuse() {
+    local actual=0
+    "$WORK/clox" "$2" > "$WORK/actual.out" 2> /dev/null || actual=$?
+    if [ "$actual" != 65 ] || [ -s "$WORK/actual.out" ]; then
+        echo "FAIL $1: exit status $actual, expected 65"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+TESTS=0
+for script in $(find test -name '*.lox' | sort); do
+    STATUS=$(expectations "$script")
+    check "$script" "$STATUS" "$WORK/clox" "$script"
+    check "$script -O" "$STATUS" "$WORK/clox" -O "$script"
+    check "$script -T" "$STATUS" "$WORK/clox" -T "$script"
+    check "$script -O -T" "$STATUS" "$WORK/clox" -O -T "$script"
+    TESTS=$((TESTS + 1))
+
+    if [ "$STATUS" = 65 ]; then
+        check "$script --compile" 65 "$WORK/clox" --compile "$script" -o "$WORK/image.loxc"
+        continue
+    fi
+    if ! "$WORK/clox" --compile "$script" -o "$WORK/image.loxc"; then
+        echo "FAIL $script --compile"
+        FAILURES=$((FAILURES + 1))
+        continue
+    fi
+    check "$script [image]" "$STATUS" "$WORK/clox" "$WORK/image.loxc"
+    cp "$script" "$WORK/cached.lox"
+    cp "$WORK/image.loxc" "$WORK/cached.loxc"
+    check "$script [cached]" "$STATUS" "$WORK/clox" "$WORK/cached.lox"
+
+    SIZE=$(wc -c < "$WORK/image.loxc")
+    head -c $((SIZE - 1)) "$WORK/image.loxc" > "$WORK/corrupt.loxc"
+    refuse "$script [truncated image]" "$WORK/corrupt.loxc"
+    cp "$WORK/image.loxc" "$WORK/corrupt.loxc"
+    printf '\377' | dd of="$WORK/corrupt.loxc" bs=1 seek=4 conv=notrunc 2> /dev/null # the version
+    refuse "$script [image of another version]" "$WORK/corrupt.loxc"
+done
+
+# An image cached for an older version of the source is ignored
+echo 'print `cached`;' > "$WORK/stale.lox"
+"$WORK/clox" --compile "$WORK/stale.lox" -o "$WORK/stale.loxc"
+echo 'print `changed`;' > "$WORK/stale.lox"
+echo changed > "$WORK/expected.out"
+: > "$WORK/expected.err"
+check "stale cached image" 0 "$WORK/clox" "$WORK/stale.lox"
+
+# clox build over a tree with a nested directory, a script that doesn't compile and a symlink
+# back up the tree, which mustn't be followed. Every image it writes must run like its source
+mkdir -p "$WORK/tree/nested"
+BUILT=0
+for script in $(find test -name '*.lox' | sort); do
+    [ "$(expectations "$script")" = 65 ] && continue
+    if [ $((BUILT % 2)) = 0 ]; then
+        cp "$script" "$WORK/tree/$BUILT.lox"
+    else
+        cp "$script" "$WORK/tree/nested/$BUILT.lox"
+    fi
+    BUILT=$((BUILT + 1))
+done
+cp test/folding/missing_operand.lox "$WORK/tree/nested/broken.lox"
+ln -s .. "$WORK/tree/nested/loop"
+ACTUAL=0
+"$WORK/clox" build -j 2 "$WORK/tree" > "$WORK/build.out" 2> /dev/null || ACTUAL=$?
+if [ "$ACTUAL" != 65 ] || ! grep -q "^Built $BUILT of $((BUILT + 1)) scripts" "$WORK/build.out"; then
+    echo "FAIL clox build: exit status $ACTUAL, expected 65"
+    cat "$WORK/build.out"
+    FAILURES=$((FAILURES + 1))
+fi
+IMAGES=0
+for image in $(find "$WORK/tree" -name '*.loxc' | sort); do
+    STATUS=$(expectations "${image%c}")
+    check "clox build $image" "$STATUS" "$WORK/clox" "$image"
+    IMAGES=$((IMAGES + 1))
+done
+if [ "$IMAGES" != "$BUILT" ]; then
+    echo "FAIL clox build: $IMAGES images, expected $BUILT"
+    FAILURES=$((FAILURES + 1))
+fi
+
+# Several VMs on one thread, through the C API
+SOURCES=$(ls *.c | grep -v '^main.c$')
+$CC -DNDEBUG -pthread -I. -o "$WORK/vms" test/vms.c $(echo "$SOURCES")
+if ! "$WORK/vms" > /dev/null; then
+    echo "FAIL test/vms.c"
+    FAILURES=$((FAILURES + 1))
+fi
+
+echo "$TESTS scripts, $FAILURES failures"
+[ "$FAILURES" = 0 ]
@@ -12,82 +12,122 @@ void initTable(Table *table)
 {
     table->count = 0;
     table->capacity = 0;
+    table->hashes = NULL;
     table->entries = NULL;
 }
 
 void freeTable(Table *table)
 {
+    FREE_ARRAY(uint32_t, table->hashes, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
+// The hash stored for a key. 0 marks empty slots, so no stored hash may be 0
+static inline uint32_t slotHash(uint32_t hash)
+{
+    return hash != 0 ? hash : 1;
+}
+
+// How far a slot at `index` holding `hash` sits from the slot that hash prefers
+static inline uint32_t probeDistance(uint32_t hash, uint32_t index, uint32_t mask)
+{
+    return (index - hash) & mask;
+}
+
 /*
-Finds an entry in hash table.
-Entry is arbitrary, meaning that in servers different purposes in different cases.
+Finds the slot holding a key with `hash` for which `matches` says yes, or -1.
+Robin Hood insertion keeps every probe run ordered by distance from the preferred slot, so the
+search can stop at the first slot that is closer to home than the key would be at that point.
+Keys are only looked at when their stored hash is equal.
 */
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+#define FIND_SLOT(table, hash, matches)                                          \
+    do                                                                           \
+    {                                                                            \
+        uint32_t mask = (table)->capacity - 1; /* capacity is a power of two */  \
+        uint32_t index = (hash) & mask;                                          \
+        for (uint32_t distance = 0;; distance++)                                 \
+        {                                                                        \
+            uint32_t stored = (table)->hashes[index];                            \
+            if (stored == 0 || probeDistance(stored, index, mask) < distance)    \
+                return -1;                                                       \
+            if (stored == (hash) && (matches))                                   \
+                return (int)index;                                               \
+            index = (index + 1) & mask;                                          \
+        }                                                                        \
+    } while (false)
+
+static int findSlot(Table *table, ObjString *key)
 {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
+    uint32_t hash = slotHash(key->hash);
+    FIND_SLOT(table, hash, table->entries[index].key == key);
+}
 
-    for (;;)
+static int findStringSlot(Table *table, const char *chars, int length, uint32_t hash)
+{
+    FIND_SLOT(table, hash, table->entries[index].key->length == length &&
+                               memcmp(table->entries[index].key->chars, chars, length) == 0);
+}
+
+/*
+Puts a key that is not in the table yet into its place, displacing entries that are closer to their
+preferred slot than the one being carried ("robbing the rich"). Never fails while a slot is empty.
+*/
+static void insertEntry(uint32_t *hashes, Entry *entries, int capacity, uint32_t hash, ObjString *key, Value value)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t index = hash & mask;
+
+    for (uint32_t distance = 0;; distance++)
     {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
+        uint32_t stored = hashes[index];
+        if (stored == 0)
         {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // We found a tombstone.
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
+            hashes[index] = hash;
+            entries[index].key = key;
+            entries[index].value = value;
+            return;
         }
-        else if (entry->key == key)
+
+        uint32_t existing = probeDistance(stored, index, mask);
+        if (existing < distance)
         {
-            // We found the key.
-            return entry;
+            Entry carried = entries[index];
+            hashes[index] = hash;
+            entries[index].key = key;
+            entries[index].value = value;
+            hash = stored;
+            key = carried.key;
+            value = carried.value;
+            distance = existing;
         }
 
-        index = (index + 1) % capacity;
-    }
-}
-
-static void rebuild(Table *table, Entry *entries, int capacity)
-{
-    for (int i = 0; i < table->capacity; i++)
-    {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
-            continue;
-
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        index = (index + 1) & mask;
     }
 }
 
 static void adjustCapacity(Table *table, int capacity)
 {
+    uint32_t *hashes = ALLOCATE(uint32_t, capacity);
     Entry *entries = ALLOCATE(Entry, capacity);
-    table->count = 0;
-
     for (int i = 0; i < capacity; i++)
     {
+        hashes[i] = 0;
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
 
-    rebuild(table, entries, capacity);
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (table->hashes[i] != 0)
+            insertEntry(hashes, entries, capacity, table->hashes[i], table->entries[i].key, table->entries[i].value);
+    }
 
-    // release old array
+    // release old arrays
+    FREE_ARRAY(uint32_t, table->hashes, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
 
+    table->hashes = hashes;
     table->entries = entries;
     table->capacity = capacity;
 }
@@ -101,51 +141,68 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot < 0)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 // Adds the given key/value pair to the given hash `Table`
-// @return `bool` - is variable defined in the `Table`
+// @return `bool` - was the key absent from the `Table` before
 bool tableSet(Table *table, ObjString *key, Value value)
 {
+    if (table->count > 0)
+    {
+        int slot = findSlot(table, key);
+        if (slot >= 0)
+        {
+            table->entries[slot].value = value;
+            return false;
+        }
+    }
+
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry == NULL)
-        return false;
-
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
-
-    entry->key = key;
-    entry->value = value;
+    insertEntry(table->hashes, table->entries, table->capacity, slotHash(key->hash), key, value);
+    table->count++;
     return true;
 }
 
-// Deletes an `Entry` from `Table`
+// Deletes an `Entry` from `Table`.
+// Shifts the rest of its probe run back one slot, so no tombstones are left behind
 bool tableDelete(Table *table, ObjString *key)
 {
     if (table->count == 0)
         return false;
 
-    // Find the entry.
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot < 0)
         return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = (uint32_t)slot;
+    for (;;)
+    {
+        uint32_t next = (index + 1) & mask;
+        uint32_t stored = table->hashes[next];
+        if (stored == 0 || probeDistance(stored, next, mask) == 0)
+            break;
+
+        table->hashes[index] = stored;
+        table->entries[index] = table->entries[next];
+        index = next;
+    }
+
+    table->hashes[index] = 0;
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
     return true;
 }
 
@@ -154,38 +211,19 @@ void tableAddAll(Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (from->hashes[i] != 0)
         {
-            tableSet(to, entry->key, entry->value);
+            tableSet(to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
 
-// Finds a string in hash table. Use this instead of `findEntry` in production.
+// Finds a string in hash table by its characters. This is how strings get interned
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
 {
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;)
-    {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
-        {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
-        {
-            // We found it.
-            return entry->key;
-        }
-
-        index = (index + 1) % table->capacity;
-    }
+    int slot = findStringSlot(table, chars, length, slotHash(hash));
+    return slot < 0 ? NULL : table->entries[slot].key;
 }
\ No newline at end of file
@@ -14,8 +14,9 @@ typedef struct
 // Hash table
 typedef struct
 {
-    int count;
-    int capacity;
+    int count;        // Live entries. Deleting shifts entries back, so there are no tombstones
+    int capacity;     // Always 0 or a power of two, so probing can mask instead of dividing
+    uint32_t *hashes; // Hash of the key in each slot, 0 if empty. Probing reads only this until a hash matches
     Entry *entries;
 } Table;
 
@@ -0,0 +1,61 @@
+// Two VMs used in turn on one thread: every call must allocate from, and free to, the heap of
+// the VM it is given, whichever VM was used last. Built and run by scripts/test.sh.
+#include <stdio.h>
+
+#include "compiler.h"
+#include "image.h"
+#include "vm.h"
+
+static int failures = 0;
+
+static void expect(bool passed, const char *what)
+{
+    if (!passed)
+    {
+        fprintf(stderr, "FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static const char *script = "var s = `a string` + ` long enough to be a rope, or close to it`;\n"
+                            "var t = s + s;\n"
+                            "print t == s + s;\n";
+
+int main(void)
+{
+    VM a;
+    VM b;
+    initVM(&a);
+    initVM(&b);
+    expect(interpret(&a, script) == INTERPRET_OK, "a runs");
+    expect(interpret(&b, script) == INTERPRET_OK, "b runs");
+
+    // `b` was initialised last, but only `a` may pay for its compilation
+    size_t bytes = b.bytesAllocated;
+    Chunk chunk;
+    initChunk(&chunk);
+    expect(compile(&a, script, &chunk), "a compiles");
+    expect(interpretChunk(&a, &chunk) == INTERPRET_OK, "a runs its chunk");
+
+    FILE *file = tmpfile();
+    expect(file != NULL && writeImage(&a, &chunk, 0, file), "a writes an image");
+    releaseChunk(&a, &chunk);
+    if (file != NULL)
+    {
+        static uint8_t image[4096];
+        rewind(file);
+        size_t size = fread(image, 1, sizeof(image), file);
+        fclose(file);
+        expect(readImage(&a, image, size, &chunk, false), "a loads the image");
+        expect(interpretChunk(&a, &chunk) == INTERPRET_OK, "a runs the image");
+        releaseChunk(&a, &chunk);
+    }
+    expect(b.bytesAllocated == bytes, "a's compilation and image stay out of b's heap");
+
+    freeVM(&a);
+    expect(b.bytesAllocated == bytes, "freeing a leaves b's heap alone");
+    expect(interpret(&b, script) == INTERPRET_OK, "b runs after a is freed");
+    freeVM(&b);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -34,6 +34,16 @@ void freeValueArray(ValueArray *array)
 
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+        printf(AS_BOOL(value) ? "true" : "false");
+    else if (IS_NIL(value))
+        printf("nil");
+    else if (IS_NUMBER(value))
+        printf("%g", AS_NUMBER(value));
+    else if (IS_OBJ(value))
+        printObject(value);
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -48,7 +58,11 @@ void printValue(Value value)
     case VAL_OBJ:
         printObject(value);
         break;
+    case VAL_UNDEFINED:
+        printf("<undefined>");
+        break;
     }
+#endif
 }
 
 // Check if two `ObjString`s are equal by value
@@ -62,6 +76,12 @@ bool stringsEqual(ObjString *a, ObjString *b)
 // Checks if two `Value`s are equal by value
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // NaN is never equal to itself, so numbers can't be compared bitwise
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -71,10 +91,12 @@ bool valuesEqual(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_NIL:
+    case VAL_UNDEFINED:
         return true;
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b);
     default:
         return false; // unreachable
     }
+#endif
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,7 +26,7 @@ static void runtimeError(VM *vm, const char *format, ...)
     fputs("\n", stderr);
 
     size_t instruction = vm->ip - vm->chunk->code - 1;
-    int line = vm->chunk->lines[instruction];
+    int line = getLine(vm->chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
     resetStack(vm);
 }
@@ -35,77 +36,103 @@ void initVM(VM *vm)
     vm->chunk = NULL;
     vm->ip = NULL;
     vm->objects = NULL;
-    initTable(&vm->globals);
+    vm->bytesAllocated = 0;
+    vm->nextGC = GC_INITIAL_THRESHOLD;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->gcPhase = GC_IDLE;
+    vm->gcStepBudget = GC_STEP_BUDGET;
+    vm->nextGCStep = 0;
+    vm->optimize = false;
+    vm->bufferTokens = false;
+    vm->sharedStrings = NULL;
+    vm->sweepLink = NULL;
+    vm->sweepNewObjects = NULL;
+    vm->sweepNewTail = NULL;
+    initAllocator(&vm->allocator);
+    setHeapVM(vm);
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalNames);
+    initValueArray(&vm->globalValues);
     initTable(&vm->strings);
     resetStack(vm);
 }
 
 void freeVM(VM *vm)
 {
-    freeTable(&vm->globals);
+    VM *previous = setHeapVM(vm);
+    freeTable(&vm->globalSlots);
+    freeValueArray(&vm->globalNames);
+    freeValueArray(&vm->globalValues);
     freeTable(&vm->strings);
     freeObjects(vm);
+#ifdef DEBUG_POOL_STATS
+    printAllocatorStats(&vm->allocator);
+#endif
+    freeAllocator(&vm->allocator);
+    setHeapVM(previous != vm ? previous : NULL);
+#ifdef DEBUG_PROFILE_PAIRS
+    printPairProfile();
+#endif
 }
 
-static Value peek(VM *vm, int distance)
+/*
+Returns the slot of global variable `name`, reserving a new undefined one on first use.
+Slots are never released, so bytecode can address globals by index.
+*/
+int globalSlot(VM *vm, ObjString *name)
 {
-    return vm->stackTop[-1 - distance];
-}
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot))
+        return (int)AS_NUMBER(slot);
 
-static bool isFalsey(Value value)
-{
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    int index = vm->globalValues.count;
+    push(vm, OBJ_VAL(name)); // keep `name` alive while the arrays grow
+    writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm->globalNames, OBJ_VAL(name));
+    tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+    pop(vm);
+    return index;
 }
 
 static void concatenate(VM *vm)
 {
-    ObjString *b = AS_STRING(pop(vm));
-    ObjString *a = AS_STRING(pop(vm));
+    // Operands stay on the stack until the result exists, so a collection can't free them
+    Obj *b = AS_OBJ(vm->stackTop[-1]);
+    Obj *a = AS_OBJ(vm->stackTop[-2]);
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Obj *result;
+    int length = textLength(a) + textLength(b);
+    if (length < ROPE_MIN_LENGTH)
+    {
+        // Ropes are never this short, so both operands are flat strings
+        ObjString *left = (ObjString *)a;
+        ObjString *right = (ObjString *)b;
+        ObjString *string = allocateString(length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        result = (Obj *)takeString(vm, string);
+    }
+    else
+        result = (Obj *)newRope(vm, a, b); // copied and interned only if it gets compared
 
-    ObjString *result = takeString(vm, chars, length);
+    pop(vm);
+    pop(vm);
     push(vm, OBJ_VAL(result));
 }
 
-// Evaluates diamond `<>` operator on two numeric `Value`s
-static int diamond(VM *vm, Value a, Value b)
+// Replaces a rope at `slot` of the stack with its interned string, so it compares by identity
+static void flattenSlot(VM *vm, Value *slot)
 {
-    if (!IS_NUMBER(a) || !IS_NUMBER(b))
-    {
-        runtimeError(vm, "Operands must be numbers.");
-        return 0; // unreachable
-    }
-    if (AS_NUMBER(a) < AS_NUMBER(b))
-        return -1;
-    else if (AS_NUMBER(a) == AS_NUMBER(b))
-        return 0;
-    else
-        return 1;
+    if (IS_ROPE(*slot))
+        *slot = OBJ_VAL(flattenRope(vm, AS_ROPE(*slot)));
 }
 
-InterpretResult run(VM *vm)
-{
-#define READ_BYTE() (*vm->ip++)
-#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(vm, valueType, op)                            \
-    do                                                          \
-    {                                                           \
-        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
-        {                                                       \
-            runtimeError(vm, "Operands must be numbers.");      \
-            return INTERPRET_RUNTIME_ERROR;                     \
-        }                                                       \
-        double b = AS_NUMBER(pop(vm));                          \
-        double a = AS_NUMBER(pop(vm));                          \
-        push(vm, valueType(a op b));                            \
-    } while (false)
 #ifdef DEBUG_TRACE_EXECUTION
+// Prints the stack contents and the instruction about to be executed
+static void traceExecution(VM *vm)
+{
     printf("\t");
     for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
     {
@@ -115,176 +142,457 @@ InterpretResult run(VM *vm)
     }
     printf(" ");
     disassembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
+#endif
+
+InterpretResult run(VM *vm)
+{
+    // The hot registers live in locals so the compiler can keep them in machine registers.
+    // They are written back to the `VM` before anything that may inspect it: errors,
+    // tracing and allocations.
+    uint8_t *ip = vm->ip;
+    Value *stackTop = vm->stackTop;
+    Value *constants = vm->chunk->constants.values;
+    Value *globals = vm->globalValues.values;
+
+#define READ_BYTE() (*ip++)
+#define READ_LONG() (ip += 3, (uint32_t)ip[-3] | ((uint32_t)ip[-2] << 8) | ((uint32_t)ip[-1] << 16))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm->globalNames.values[slot])
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define STORE_REGISTERS() (vm->ip = ip, vm->stackTop = stackTop)
+#define LOAD_REGISTERS() (ip = vm->ip, stackTop = vm->stackTop)
+#define RUNTIME_ERROR(...)                  \
+    do                                      \
+    {                                       \
+        STORE_REGISTERS();                  \
+        runtimeError(vm, __VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+#define GET_GLOBAL(slot)                                                \
+    do                                                                  \
+    {                                                                   \
+        uint32_t index = (slot);                                        \
+        if (IS_UNDEFINED(globals[index]))                               \
+            RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(index)); \
+        PUSH(globals[index]);                                           \
+    } while (false)
+#define SET_GLOBAL(slot)                                                \
+    do                                                                  \
+    {                                                                   \
+        uint32_t index = (slot);                                        \
+        if (IS_UNDEFINED(globals[index]))                               \
+            RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(index)); \
+        WRITE_BARRIER(PEEK(0));                                         \
+        globals[index] = PEEK(0);                                       \
+    } while (false)
+#ifdef INCREMENTAL_GC
+// Globals may have been scanned already in the current cycle, so a stored object is marked
+// right away (Dijkstra insertion barrier). The stack needs none, the collector rescans it last.
+#define WRITE_BARRIER(value)                \
+    do                                      \
+    {                                       \
+        if (vm->gcPhase == GC_MARK)         \
+            markValue(vm, value);           \
+    } while (false)
+#else
+#define WRITE_BARRIER(value) ((void)0)
 #endif
+#define BINARY_OP(valueType, op)                                \
+    do                                                          \
+    {                                                           \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))         \
+            RUNTIME_ERROR("Operands must be numbers.");         \
+        double b = AS_NUMBER(POP());                            \
+        PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b);           \
+    } while (false)
+
+// Ropes of equal length are flattened so equality can compare interned strings by identity.
+// Texts of different lengths can't be equal, and distinct objects compare unequal anyway
+#define FLATTEN_OPERANDS()                                                                    \
+    do                                                                                        \
+    {                                                                                         \
+        if ((IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) && IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)) && \
+            textLength(AS_OBJ(PEEK(0))) == textLength(AS_OBJ(PEEK(1))))                       \
+        {                                                                                     \
+            STORE_REGISTERS();                                                                \
+            flattenSlot(vm, vm->stackTop - 1);                                                \
+            flattenSlot(vm, vm->stackTop - 2);                                                \
+            LOAD_REGISTERS();                                                                 \
+        }                                                                                     \
+    } while (false)
+#define ADD()                                                            \
+    do                                                                   \
+    {                                                                    \
+        if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)))                        \
+        {                                                                \
+            if (textLength(AS_OBJ(PEEK(1))) > INT_MAX - textLength(AS_OBJ(PEEK(0)))) \
+                RUNTIME_ERROR("String too long.");                       \
+            STORE_REGISTERS();                                           \
+            concatenate(vm);                                             \
+            LOAD_REGISTERS();                                            \
+        }                                                                \
+        else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))               \
+        {                                                                \
+            double b = AS_NUMBER(POP());                                 \
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);                \
+        }                                                                \
+        else                                                             \
+            RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+    } while (false)
+// `ADD()` with the right operand coming from the instruction instead of the stack
+#define ADD_OPERAND(operand)                                             \
+    do                                                                   \
+    {                                                                    \
+        Value b = (operand);                                             \
+        if (IS_NUMBER(b) && IS_NUMBER(PEEK(0)))                          \
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(b));     \
+        else                                                             \
+        {                                                                \
+            PUSH(b);                                                     \
+            ADD();                                                       \
+        }                                                                \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE() (STORE_REGISTERS(), traceExecution(vm))
+#elif defined(DEBUG_PROFILE_PAIRS)
+#define TRACE() profileInstruction(*ip)
+#else
+#define TRACE() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Every handler ends by jumping straight to the next one, so each opcode gets
+    // its own indirect branch and the predictor can learn common successors.
+    static void *dispatchTable[] = {
+        [OP_RETURN] = &&CASE_OP_RETURN,
+        [OP_CONSTANT] = &&CASE_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&CASE_OP_CONSTANT_LONG,
+        [OP_NEGATE] = &&CASE_OP_NEGATE,
+        [OP_PRINT] = &&CASE_OP_PRINT,
+        [OP_NIL] = &&CASE_OP_NIL,
+        [OP_TRUE] = &&CASE_OP_TRUE,
+        [OP_FALSE] = &&CASE_OP_FALSE,
+        [OP_NOT] = &&CASE_OP_NOT,
+        [OP_OR] = &&CASE_UNKNOWN,
+        [OP_XOR] = &&CASE_UNKNOWN,
+        [OP_AND] = &&CASE_UNKNOWN,
+        [OP_EQUAL] = &&CASE_OP_EQUAL,
+        [OP_GREATER] = &&CASE_OP_GREATER,
+        [OP_LESS] = &&CASE_OP_LESS,
+        [OP_DIAMOND] = &&CASE_OP_DIAMOND,
+        [OP_ADD] = &&CASE_OP_ADD,
+        [OP_SUBTRACT] = &&CASE_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&CASE_OP_MULTIPLY,
+        [OP_DIVIDE] = &&CASE_OP_DIVIDE,
+        [OP_POP] = &&CASE_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&CASE_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&CASE_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&CASE_OP_SET_GLOBAL,
+        [OP_DEFINE_GLOBAL_LONG] = &&CASE_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL_LONG] = &&CASE_OP_GET_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&CASE_OP_SET_GLOBAL_LONG,
+        [OP_GET_LOCAL] = &&CASE_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&CASE_OP_SET_LOCAL,
+        [OP_NOT_EQUAL] = &&CASE_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&CASE_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&CASE_OP_LESS_EQUAL,
+        [OP_ADD_CONST] = &&CASE_OP_ADD_CONST,
+        [OP_GET_GLOBAL_ADD] = &&CASE_OP_GET_GLOBAL_ADD,
+        [OP_GET_LOCAL_ADD] = &&CASE_OP_GET_LOCAL_ADD,
+        [OP_SET_GLOBAL_POP] = &&CASE_OP_SET_GLOBAL_POP,
+        [OP_SET_LOCAL_POP] = &&CASE_OP_SET_LOCAL_POP,
+    };
+
+#define DISPATCH()                          \
+    do                                      \
+    {                                       \
+        TRACE();                            \
+        goto *dispatchTable[READ_BYTE()];   \
+    } while (false)
+#define CASE(opcode) CASE_##opcode:
+#define DEFAULT CASE_UNKNOWN:
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE())
+    DISPATCH();
+#else
+#define DISPATCH() continue
+#define CASE(opcode) case opcode:
+#define DEFAULT default:
+
+    for (;;)
     {
-    case OP_POP:
+        TRACE();
+        switch (READ_BYTE())
+        {
+#endif
+    CASE(OP_POP)
     {
-        pop(vm);
-        break;
+        stackTop--;
+        DISPATCH();
     }
-    case OP_DEFINE_GLOBAL:
+    CASE(OP_DEFINE_GLOBAL)
     {
-        ObjString *name = READ_STRING();
-        tableSet(&vm->globals, name, peek(vm, 0));
-        pop(vm);
-        break;
+        WRITE_BARRIER(PEEK(0));
+        globals[READ_BYTE()] = POP();
+        DISPATCH();
     }
-    case OP_GET_GLOBAL:
+    CASE(OP_DEFINE_GLOBAL_LONG)
     {
-        ObjString *name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm->globals, name, &value))
-        {
-            runtimeError(vm, "Undefined variable '%s'.", name->chars);
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        push(vm, value);
-        break;
+        WRITE_BARRIER(PEEK(0));
+        globals[READ_LONG()] = POP();
+        DISPATCH();
     }
-    case OP_SET_GLOBAL:
+    CASE(OP_GET_GLOBAL)
     {
-        ObjString *name = READ_STRING();
-        if (tableSet(&vm->globals, name, peek(vm, 0))) // TODO: Always returns true, it's wrong
-        {
-            tableDelete(&vm->globals, name);
-            runtimeError(vm, "Undefined variable '%s'.", name->chars);
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+        GET_GLOBAL(READ_BYTE());
+        DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL_LONG)
+    {
+        GET_GLOBAL(READ_LONG());
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL)
+    {
+        SET_GLOBAL(READ_BYTE());
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_LONG)
+    {
+        SET_GLOBAL(READ_LONG());
+        DISPATCH();
     }
-    case OP_PRINT:
+    CASE(OP_GET_LOCAL)
     {
-        printValue(pop(vm));
+        PUSH(vm->stack[READ_BYTE()]);
+        DISPATCH();
+    }
+    CASE(OP_SET_LOCAL)
+    {
+        vm->stack[READ_BYTE()] = PEEK(0);
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_POP)
+    {
+        SET_GLOBAL(READ_BYTE());
+        stackTop--;
+        DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP)
+    {
+        vm->stack[READ_BYTE()] = POP();
+        DISPATCH();
+    }
+    CASE(OP_PRINT)
+    {
+        printValue(POP());
         printf("\n");
-        break;
+        DISPATCH();
     }
-    case OP_DIAMOND:
+    CASE(OP_DIAMOND)
     {
-        Value b = pop(vm);
-        Value a = pop(vm);
-        push(vm, NUMBER_VAL(diamond(vm, a, b)));
-        break;
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            RUNTIME_ERROR("Operands must be numbers.");
+        double b = AS_NUMBER(POP());
+        PEEK(0) = NUMBER_VAL(diamond(AS_NUMBER(PEEK(0)), b));
+        DISPATCH();
     }
-    case OP_EQUAL:
+    CASE(OP_EQUAL)
     {
-        Value b = pop(vm);
-        Value a = pop(vm);
-        push(vm, BOOL_VAL(valuesEqual(a, b)));
-        break;
+        FLATTEN_OPERANDS();
+        Value b = POP();
+        PEEK(0) = BOOL_VAL(valuesEqual(PEEK(0), b));
+        DISPATCH();
     }
-    case OP_GREATER:
+    CASE(OP_NOT_EQUAL)
     {
-        BINARY_OP(vm, BOOL_VAL, >);
-        break;
+        FLATTEN_OPERANDS();
+        Value b = POP();
+        PEEK(0) = BOOL_VAL(!valuesEqual(PEEK(0), b));
+        DISPATCH();
     }
-    case OP_LESS:
+    CASE(OP_GREATER)
     {
-        BINARY_OP(vm, BOOL_VAL, <);
-        break;
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
     }
-    case OP_CONSTANT:
+    CASE(OP_LESS)
     {
-        Value constant = READ_CONSTANT();
-        push(vm, constant);
-        break;
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
     }
-    case OP_CONSTANT_LONG:
+    // The fused comparisons negate the opposite test instead of using `>=` and `<=`,
+    // so NaN operands give the same result as the unfused pair
+    CASE(OP_GREATER_EQUAL)
     {
-        Value constant = READ_CONSTANT();
-        push(vm, constant);
-        break;
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            RUNTIME_ERROR("Operands must be numbers.");
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(!(AS_NUMBER(PEEK(0)) < b));
+        DISPATCH();
     }
-    case OP_NIL:
+    CASE(OP_LESS_EQUAL)
     {
-        push(vm, NIL_VAL);
-        break;
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))
+            RUNTIME_ERROR("Operands must be numbers.");
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(!(AS_NUMBER(PEEK(0)) > b));
+        DISPATCH();
     }
-    case OP_TRUE:
+    CASE(OP_CONSTANT)
     {
-        push(vm, BOOL_VAL(true));
-        break;
+        PUSH(READ_CONSTANT());
+        DISPATCH();
     }
-    case OP_FALSE:
+    CASE(OP_CONSTANT_LONG)
     {
-        push(vm, BOOL_VAL(false));
-        break;
+        PUSH(READ_CONSTANT_LONG());
+        DISPATCH();
     }
-    case OP_NEGATE:
+    CASE(OP_NIL)
     {
-        if (!IS_NUMBER(peek(vm, 0)))
-        {
-            runtimeError(vm, "Operand must be a number.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
-        break;
+        PUSH(NIL_VAL);
+        DISPATCH();
     }
-    case OP_NOT:
-        push(vm, BOOL_VAL(isFalsey(pop(vm))));
-        break;
-    case OP_ADD:
+    CASE(OP_TRUE)
     {
-        if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1)))
-            concatenate(vm);
-        else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
-        {
-            double b = AS_NUMBER(pop(vm));
-            double a = AS_NUMBER(pop(vm));
-            push(vm, NUMBER_VAL(a + b));
-        }
-        else
-        {
-            runtimeError(vm, "Operands must be two numbers or two strings.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-    }
-    case OP_SUBTRACT:
-        BINARY_OP(vm, NUMBER_VAL, -);
-        break;
-    case OP_MULTIPLY:
-        BINARY_OP(vm, NUMBER_VAL, *);
-        break;
-    case OP_DIVIDE:
-        BINARY_OP(vm, NUMBER_VAL, /);
-        break;
-    case OP_RETURN:
+        PUSH(BOOL_VAL(true));
+        DISPATCH();
+    }
+    CASE(OP_FALSE)
+    {
+        PUSH(BOOL_VAL(false));
+        DISPATCH();
+    }
+    CASE(OP_NEGATE)
     {
+        if (!IS_NUMBER(PEEK(0)))
+            RUNTIME_ERROR("Operand must be a number.");
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
+    }
+    CASE(OP_NOT)
+    {
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+        DISPATCH();
+    }
+    CASE(OP_ADD)
+    {
+        ADD();
+        DISPATCH();
+    }
+    CASE(OP_ADD_CONST)
+    {
+        ADD_OPERAND(READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL_ADD)
+    {
+        uint8_t slot = READ_BYTE();
+        if (IS_UNDEFINED(globals[slot]))
+            RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+        ADD_OPERAND(globals[slot]);
+        DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_ADD)
+    {
+        ADD_OPERAND(vm->stack[READ_BYTE()]);
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT)
+    {
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY)
+    {
+        BINARY_OP(NUMBER_VAL, *);
+        DISPATCH();
+    }
+    CASE(OP_DIVIDE)
+    {
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
+    }
+    CASE(OP_RETURN)
+    {
+        STORE_REGISTERS();
         return INTERPRET_OK;
     }
+    DEFAULT
+    {
+        RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+    }
+#ifndef COMPUTED_GOTO
+        }
     }
-
-    return INTERPRET_OK; // unreachable
+#endif
 
 #undef READ_BYTE
+#undef READ_LONG
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef GLOBAL_NAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_REGISTERS
+#undef LOAD_REGISTERS
+#undef RUNTIME_ERROR
+#undef GET_GLOBAL
+#undef SET_GLOBAL
+#undef WRITE_BARRIER
 #undef BINARY_OP
+#undef FLATTEN_OPERANDS
+#undef ADD
+#undef ADD_OPERAND
+#undef TRACE
+#undef DISPATCH
+#undef CASE
+#undef DEFAULT
 }
 
 InterpretResult interpret(VM *vm, const char *source)
 {
+    VM *previous = setHeapVM(vm);
     Chunk chunk;
     initChunk(&chunk);
+    vm->constantsCursor = 0; // a collection in progress hasn't seen this chunk's constants
 
-    if (!compile(vm, source, &chunk))
-    {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
-    }
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
+    if (compile(vm, source, &chunk))
+        result = interpretChunk(vm, &chunk);
+    freeChunk(&chunk);
+    setHeapVM(previous);
+    return result;
+}
 
-    vm->chunk = &chunk;
+// Runs a chunk compiled earlier, or loaded from an image (see image.c). The caller frees it with `releaseChunk()`
+InterpretResult interpretChunk(VM *vm, Chunk *chunk)
+{
+    VM *previous = setHeapVM(vm);
+    vm->constantsCursor = 0;
+    vm->chunk = chunk;
     vm->ip = vm->chunk->code;
 
     InterpretResult result = run(vm);
-
-    freeChunk(&chunk);
+    vm->chunk = NULL; // the chunk may be freed next, so it must stop being a root
+    setHeapVM(previous);
     return result;
 }
 
+// Frees a chunk `vm` compiled or loaded, back into the heap it came from
+void releaseChunk(VM *vm, Chunk *chunk)
+{
+    VM *previous = setHeapVM(vm);
+    freeChunk(chunk);
+    setHeapVM(previous);
+}
+
 void push(VM *vm, Value value)
 {
     *vm->stackTop = value;
@@ -1,22 +1,50 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "allocator.h"
 #include "value.h"
 #include "scanner.h"
 #include "table.h"
 #include "chunk.h"
 
-#define STACK_MAX 256 // Self-proclaimed
+#define STACK_MAX (UINT8_COUNT * 2) // Deepest a chunk may take the stack: room for every local, and as many temporaries
+
+typedef enum
+{
+    GC_IDLE,  // No collection in progress
+    GC_MARK,  // Tracing roots and gray objects
+    GC_SWEEP, // Freeing objects left white
+} GCPhase;
 
 typedef struct
 {
-    Chunk *chunk;           // Currently processed 'Chunk' of Lox code
-    uint8_t *ip;            // Instruction Pointer
-    Value stack[STACK_MAX]; // Keeps all constants during current chunk execution
-    Value *stackTop;        // Points to where the next value to be pushed will go
-    Table strings;          // Hash table of all user-defined strings
-    Table globals;          // Global variables
-    Obj *objects;           // Intrusive list of user-defined `Objects`
+    Chunk *chunk;            // 'Chunk' being run, compiled or loaded. Its constants are GC roots
+    uint8_t *ip;             // Instruction Pointer
+    Value stack[STACK_MAX + 2]; // Keeps all constants during current chunk execution. The slots past `STACK_MAX` hold what `ADD_OPERAND()` and `internString()` push on top
+    Value *stackTop;         // Points to where the next value to be pushed will go
+    Table strings;           // Hash table of all user-defined strings
+    Table globalSlots;       // Maps global variable names to their slot
+    ValueArray globalNames;  // Global variable names, indexed by slot
+    ValueArray globalValues; // Global variable values, indexed by slot. `UNDEFINED_VAL` until defined
+    Obj *objects;            // Intrusive list of user-defined `Objects`
+    size_t bytesAllocated;   // Bytes currently owned through `reallocate()`
+    size_t nextGC;           // `bytesAllocated` threshold that triggers the next collection
+    int grayCount;           // Marked objects whose references are not traced yet
+    int grayCapacity;
+    Obj **grayStack;
+    GCPhase gcPhase;         // Where the current collection is. Always `GC_IDLE` between stop-the-world collections
+    int gcStepBudget;        // Objects or root slots one incremental step may process
+    size_t nextGCStep;       // `bytesAllocated` threshold that triggers the next incremental step
+    int namesCursor;         // `globalNames` slots already marked in this cycle
+    int valuesCursor;        // `globalValues` slots already marked in this cycle
+    int constantsCursor;     // Constants of the current chunk already marked in this cycle
+    Obj **sweepLink;         // Link to the next object to sweep
+    Obj *sweepNewObjects;    // Objects allocated while sweeping, merged into `objects` when sweep ends
+    Obj *sweepNewTail;
+    Allocator allocator;     // Size-class pools behind every `reallocate()` made for this VM
+    bool optimize;           // Compile through the optimiser (see optimizer.c). Set by -O
+    bool bufferTokens;       // Scan the whole source before parsing it (see `TokenBuffer`). Set by -T
+    struct InternPool *sharedStrings; // Interns strings there instead of in `strings` when set (see intern.h)
 } VM;
 
 typedef enum
@@ -29,6 +57,9 @@ typedef enum
 void initVM(VM *vm);
 void freeVM(VM *vm);
 InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretChunk(VM *vm, Chunk *chunk);
+void releaseChunk(VM *vm, Chunk *chunk);
+int globalSlot(VM *vm, ObjString *name);
 void push(VM *vm, Value value);
 Value pop(VM *vm);
 